@@ -7,18 +7,27 @@ main function used as part of elevatorSummative.c
  Date - June 11th 2012
 
  Explain Operation of Program here:
-	This program is designed to simulate an elevator. There are two inputs 
-        (up and down) and three floors. A stepper motor rotates to pull up a
-        paper elevator, depending on the input buttons. The interrupt is
-        designed to simulate a fire alarm within the elevator.
+	This program is designed to simulate an elevator with three floors,
+        set by BUILDING. Each floor has a car call button and up and down
+        hall call buttons, and the calls are served in sweeps by the LOOK
+        algorithm. A stepper motor rotates to pull up a paper elevator to
+        each stop in turn. The interrupt is designed to simulate a fire
+        alarm within the elevator.
 	
  Hardware Notes:
         There are three indicator LEDs which indicate the floor level, as well
-        as a red LED which indicates the fire alarm. A seven segment display
-        outputs the floor number. Two pushbutton switches are used for up and
-        down buttons and another one is used for the fire alarm. A piezoelectric
-        buzzer is used during the fire alarm sequence and to indicate that the
-        floor has arrived.
+        as a red LED which indicates the fire alarm. A two digit seven segment
+        display outputs the floor number and the direction of travel, with the
+        digits selected by RB11 and RA3. RA3 is the OSCO/CLKO pin, so it is
+        configured as port I/O by OSCIOFNC_ON. The call buttons, one in the
+        car for each floor and an up and a down button on each landing (no
+        up button at the top or down button at the ground floor), pull low
+        when pressed and are read through a chain of 74HC165 shift
+        registers. Their serial output is on RA4, the old up button pin, and
+        they are clocked and loaded on the SEG_A (RB7) and SEG_B (RB6) lines
+        while no digit is selected. Another pushbutton on RB2 (INT1) is
+        used for the fire alarm. A piezoelectric buzzer is used during the
+        fire alarm sequence and to indicate that the floor has arrived.
 
 *******************************************************************************/
 
@@ -36,82 +45,681 @@ main function used as part of elevatorSummative.c
 *******************************************************************************/
 void initializePorts (void);
 
-void initializeTimer (void);
-void delay (float milli);
-
-void handleInputs(void);
-
-void segmentDisplay (int a, int b, int c, int d, int e, int f, int g);
+void initializeSystemTick (void);
+void timerStart (int timer, unsigned int delayMs, unsigned int periodMs,
+                 void (*callback)(void));
+void timerStop (int timer);
+int timerRunning (int timer);
+unsigned long timeNow (void);
+void timerInsert (int timer, unsigned int delayMs);
+void timerUnlink (int timer);
+void __attribute__((interrupt,no_auto_psv)) _T1Interrupt (void);
+
+void runScheduler (void);
+void postEvent (int task, unsigned int events);
+unsigned int takeEvents (int task);
+int queuePut (int queue, unsigned int message);
+int queueGet (int queue, unsigned int *message);
+void signalEvent (int queue, int task, unsigned int events);
+void collectEvents (void);
+void motionTask (unsigned int events);
+void inputTask (unsigned int events);
+void displayTask (unsigned int events);
+void audioTask (unsigned int events);
+void tripTimerExpired (void);
+void tripDepart (void);
+void tripPark (void);
+void parkTimerExpired (void);
+void etaTimerExpired (void);
+void doorOpen (void);
+void doorStep (void);
+int doorRequest (void);
+void doorHurry (void);
+void doorSetTimes (unsigned int openMs, unsigned int dwellMs,
+                   unsigned int closeMs, unsigned int earlyMs);
+
+void initializeDisplay (void);
+void displaySetGlyph (int digit, int glyph);
+void displaySetNumber (int number);
+void displaySetLeds (unsigned int leds);
+void displayScan (void);
+void animationStart (int animation, unsigned int digits, unsigned int leds,
+                     unsigned int pattern, int steps, unsigned int stepMs,
+                     int repeats);
+void animationStop (int animation);
+int animationRunning (int animation);
+void animationTick (void);
 void updateIndicators(void);
 
-void elevatorUp (int cycles);
-void elevatorDown (int cycles);
+void elevatorGoTo (int floor);
+int floorPosition (int floor);
+int motionCanStopAt (int floor);
+int registerCall (int floor, unsigned char call);
+unsigned char serveCalls (unsigned char *calls, int floor, int direction);
+int stopAhead (const unsigned char *calls, int position, int direction,
+               int moving);
+int lookNextStop (const unsigned char *calls, int floor, int direction);
+void planRoute (void);
+unsigned int callEta (int floor, int type);
+unsigned int moveTime (int distance);
+void buildTravelTable (void);
+void demandAdvance (void);
+void demandRecord (int floor);
+int parkFloor (void);
+
+unsigned long readCallButtons (void);
+void buttonTick (void);
+
+void initializeStepTimer (void);
+void initializeRampTable (void);
+void motionSetProfile (int profile);
+unsigned int sCurvePeriod (int level);
+unsigned long squareRoot (unsigned long value);
+void motionMoveTo (int position);
+int motionRetarget (int position);
+int motionStoppingPosition (void);
+void motorOutput (int position);
+void motionSetDriveMode (int mode);
+void buildCoilMasks (void);
+void motorHold (void);
+void motorRelease (void);
+void __attribute__((interrupt,no_auto_psv)) _T4Interrupt (void);
 
 void initializeInterrupt1 (void);
 void __attribute__((interrupt,no_auto_psv)) _INT1Interrupt (void);
 
-void buzzer (int length);
+void initializeBuzzer (void);
+void playTune (const unsigned char *tune);
+void tuneStep (void);
+void buzzerOn (unsigned int period);
+void buzzerOff (void);
+void initializeSirenTable (void);
 void fireAlarm (void);
+void sirenStep (void);
 
 /*******************************************************************************
         Configuration Bit Macros
 *******************************************************************************/
-_CONFIG2 (FNOSC_FRC)
+_CONFIG2 (FNOSC_FRC & OSCIOFNC_ON) //RA3 is a port pin, not CLKO
 _CONFIG1 (JTAGEN_OFF & FWDTEN_OFF & ICS_PGx2)
 
 /*******************************************************************************
         Constants
 *******************************************************************************/
-#define MOTOR_DELAY                 30 //The delay between each motor step
+#define TIMER_TICKS_PER_MS          4000ul //Timer2 counts at Fcy = 4MHz
+#define MS_TO_TICKS(milli)          ((unsigned long) (milli) * TIMER_TICKS_PER_MS)
+#define US_TO_TICKS(micro)          ((unsigned long) (micro) * TIMER_TICKS_PER_MS / 1000)
+
+//System tick and software timers
+#define SYSTEM_TICK_PERIOD          (TIMER_TICKS_PER_MS - 1) //Timer1, 1ms
+#define SOFT_TIMER_COUNT            8 //Number of software timers available
+#define WHEEL_SLOTS                 16 //Timing wheel size, a power of two
+#define TIMER_IDLE                  -1 //timerSlot value of a stopped timer
+#define NO_TIMER                    -1 //End of a timing wheel slot list
+
+//Software timers
+#define TIMER_TRIP                  0 //Door phases and the fire alarm poll
+#define TIMER_TUNE                  1 //Length of the current note of a tune
+#define TIMER_SIREN                 2 //Steps the fire alarm siren sweep
+#define TIMER_PARK                  3 //Idle time before the car is parked
+#define TIMER_ETA                   4 //How long an arrival estimate is shown
+
+//Display animations
+#define ANIMATION_COUNT             2 //Number of animations that can run at once
+#define ANIMATION_FIRE              0 //Fire alarm flashing
+#define ANIMATION_STATUS            1 //Blinks the floor number on a refused press
+#define ANIMATION_FOREVER           0 //repeats value of an endless animation
+
+//Tasks, in priority order with the highest priority first
+#define TASK_MOTION                 0 //Trip control
+#define TASK_INPUT                  1 //Button handling
+#define TASK_DISPLAY                2 //Indicator LEDs and segment display
+#define TASK_AUDIO                  3 //Buzzer
+#define TASK_COUNT                  4
+
+//Queues, each filled by one interrupt and emptied by the main loop
+#define QUEUE_TICK                  0 //Task events from the Timer1 interrupt
+#define QUEUE_BUTTONS               1 //Button events from the Timer1 interrupt
+#define QUEUE_STEP                  2 //Task events from the step interrupt
+#define QUEUE_FIRE                  3 //Task events from the INT1 interrupt
+#define QUEUE_COUNT                 4
+#define QUEUE_SIZE                  8 /* Messages each queue holds, a power of
+                                       * two. signalEvent never queues the same
+                                       * message twice, so the task event
+                                       * queues need one slot per distinct
+                                       * message: 4 for QUEUE_TICK, 3 for
+                                       * QUEUE_FIRE and 1 for QUEUE_STEP. */
+#define EVENT_MESSAGE(task, events) (((task) << 12) | (events)) /* Queue message
+                                                                * for events */
+#define MESSAGE_TASK(message)       ((message) >> 12)
+#define MESSAGE_EVENTS(message)     ((message) & 0x0FFF)
+
+//TASK_MOTION events
+#define EVENT_CALL                  0x0001 //A call has been added to floorCalls
+#define EVENT_TRIP_TIMER            0x0002 //TIMER_TRIP has expired
+#define EVENT_ARRIVED               0x0004 //The step interrupt has finished
+#define EVENT_FIRE                  0x0008 //The fire alarm has gone off
+#define EVENT_DOOR_REQUEST          0x0010 //A press for the floor the car is at
+#define EVENT_CAR_CALL              0x0020 //The new call is a car call
+#define EVENT_PARK_TIMER            0x0040 //TIMER_PARK has expired
+
+//TASK_INPUT events
+#define EVENT_BUTTON                0x0001 //QUEUE_BUTTONS has button events
+
+//TASK_DISPLAY events
+#define EVENT_FLOOR_CHANGED         0x0001 //The floor or direction has changed
+#define EVENT_ALARM                 0x0002 //Show the fire alarm
+#define EVENT_REFUSED               0x0004 //A press has been refused
+#define EVENT_ETA                   0x0008 //Show the estimate for etaFloor
+
+//TASK_AUDIO events
+#define EVENT_CHIME                 0x0001 //Play the arrival tune
+#define EVENT_DEPART_UP             0x0002 //Play the going up tune
+#define EVENT_DEPART_DOWN           0x0004 //Play the going down tune
+#define EVENT_FAULT                 0x0008 //Play the fault tune
+#define EVENT_SIREN                 0x0010 //Sound the fire alarm siren
+
+//Trip states
+#define TRIP_IDLE                   0 //Waiting for a call, doors closed
+#define TRIP_DOORS                  1 //Stopped at a floor, see doorState
+#define TRIP_MOVING                 2 //The step interrupt is moving the car
+#define TRIP_FIRE                   3 //Going down for the fire alarm
+#define TRIP_PARKING                4 //Moving to parkFloor with no calls
+
+//Door states, the doors only open while the car is stopped at a floor
+#define DOOR_CLOSED                 0
+#define DOOR_OPENING                1 //Taking doorOpenTime to open
+#define DOOR_OPEN                   2 //Open for doorDwellTime
+#define DOOR_CLOSING                3 //Taking doorCloseTime to close
+
+//Default door timing in ms, see doorSetTimes
+#define DEFAULT_DOOR_OPEN_TIME      400 //Doors opening, the chime is at the end
+#define DEFAULT_DOOR_DWELL_TIME     1000 //Time for passengers to get on or off
+#define DEFAULT_DOOR_CLOSE_TIME     400 //Doors closing
+#define DEFAULT_DOOR_EARLY_DWELL    300 //Dwell left once a car call is made
+#define DOOR_MAX_REOPENS            3 //Requests honoured at each stop
+
+#define MOTOR_DELAY                 30 //The delay between steps at start/stop
+#define MOTOR_CRUISE_DELAY          10 //The delay between steps at full speed
+#define SCURVE_CRUISE_DELAY         8 //Full speed delay for the S-curve profile
+#define RAMP_STEPS                  48 //Steps taken to reach full speed
 #define ONE_FLOOR_TICKS             144 //The number of steps between each floor
-
-//Main Inputs
-#define UP_BUTTON                   _RA4
-#define DOWN_BUTTON                 _RB5
+#define DEBOUNCE_TIME               10 //ms a button must be steady to count
+#define FIRE_POLL                   50 //Checks whether the fire descent is over
+#define STEP_TIMER_TICKS_PER_MS     500 //Timer4 counts at Fcy/8 = 500kHz
+
+//Motion profiles
+#define PROFILE_CONSTANT            0 //Every step at MOTOR_DELAY
+#define PROFILE_TRAPEZOID           1 //Constant acceleration ramps
+#define PROFILE_SCURVE              2 //Jerk limited ramps
+#define DEFAULT_PROFILE             PROFILE_TRAPEZOID
+
+//Drive modes
+#define DRIVE_WAVE                  0 //One coil on at a time
+#define DRIVE_TWO_PHASE             1 //Two coils on at a time, more torque
+#define DRIVE_HALF_STEP             2 //Alternates one and two coils
+#define DEFAULT_DRIVE_MODE          DRIVE_WAVE
+#define HALF_STEPS_PER_STEP         2 //motorPosition counts half steps
+
+//Idle coil hold policies, applied once HOLD_FULL_TIME has passed
+#define HOLD_FULL                   0 //Keep the last coils fully on
+#define HOLD_REDUCED                1 //Chop the last coils at a reduced duty
+#define HOLD_RELEASE                2 //Turn all coils off
+#define DEFAULT_HOLD_POLICY         HOLD_REDUCED
+#define HOLD_FULL_TIME              500 //Full hold after arriving, in ms
+#define HOLD_TICK                   10 //Timer4 period while counting the hold
+#define HOLD_ON_TICKS               250 //Coil on time when chopping (0.5ms)
+#define HOLD_OFF_TICKS              750 //Coil off time when chopping (1.5ms)
+
+/* Main Inputs, the call buttons are read through a chain of 74HC165 shift
+ * registers. The shift register is clocked on two of the segment lines while
+ * no digit is selected. */
+#define SHIFT_DATA                  _RA4 //Serial output of the last 74HC165
+#define SHIFT_CLOCK                 _LATB7 //SEG_A, shifts on the rising edge
+#define SHIFT_LOAD                  _LATB6 //SEG_B, loads the buttons while low
+
+/* Call buttons, numbered in the order they are shifted in. Each floor has a
+ * car call button inside the car, and an up and a down hall call button on
+ * the landing, except that the top floor has no up button and the ground
+ * floor no down button. The buttons return a '0' when they are pressed. */
+#define INPUT_CAR(floor)            ((floor) - GROUND_FLOOR)
+#define INPUT_HALL_UP(floor)        (FLOOR_COUNT + (floor) - GROUND_FLOOR)
+#define INPUT_HALL_DOWN(floor)      (2 * FLOOR_COUNT - 2 + (floor) - GROUND_FLOOR)
+#define INPUT_COUNT                 (3 * FLOOR_COUNT - 2) //At most 32
+
+//Call bits in floorCalls
+#define CALL_CAR                    0b001 //Asked for from inside the car
+#define CALL_UP                     0b010 //Asked for from the floor, going up
+#define CALL_DOWN                   0b100 //Asked for from the floor, going down
+#define CALL_HALL(direction)        (((direction) > 0) ? CALL_UP : CALL_DOWN)
+#define CALL_TYPES                  3 //The call bits are 1 << call type
+
+//Arrival time estimates
+#define ETA_NONE                    0xFFFF //callEta of a call not waiting
+#define ETA_SHOW_TIME               1500 //ms the estimate of a new call is shown
+#define ETA_MAX_SECONDS             9 //Most the floor number digits can show
+
+//Idle parking
+#define PARK_DELAY                  5000 //ms idle before the car is parked
+#define DEMAND_BUCKETS              8 //Buckets of call history, a power of two
+#define DEMAND_BUCKET_TIME          60000ul //ms of call history in each bucket
+#define DEMAND_MAX                  255 //demandCount saturates here
+
+//Debounce states
+#define BUTTON_RELEASED             0 //Steady and not pressed
+#define BUTTON_PRESSING             1 //Changed while released, settling
+#define BUTTON_PRESSED              2 //Steady and pressed
+#define BUTTON_RELEASING            3 //Changed while pressed, settling
+
+//Button events are the button number, with BUTTON_EVENT_RELEASE for releases
+#define BUTTON_EVENT_RELEASE        0x80
+#define BUTTON_EVENT_BUTTON         0x7F //Bits holding the button number
 
 //Indicator LEDs
-#define FIRST_FLOOR_LED             _LATB15
-#define SECOND_FLOOR_LED            _LATB14
-#define THIRD_FLOOR_LED             _LATB13
-#define FIRE_ALARM_LED              _LATB12
-
-#define BUZZER                      _LATB10
+#define FIRST_FLOOR_LED             0b1000000000000000 //RB15
+#define SECOND_FLOOR_LED            0b0100000000000000 //RB14
+#define THIRD_FLOOR_LED             0b0010000000000000 //RB13
+#define FIRE_ALARM_LED              0b0001000000000000 //RB12
+#define LED_LATB_MASK               (FIRE_ALARM_LED \
+                                     BUILDING(FLOOR_LED_MASK_ENTRY))
+
+/* Building descriptor, one FLOOR entry per floor from the ground floor up,
+ * giving the height of the floor in steps above the ground floor and the LATB
+ * bit of its indicator LED. The floors do not have to be evenly spaced. The
+ * floor count and floor tables are all built from this list. */
+#define BUILDING(FLOOR) \
+    FLOOR(0,                   FIRST_FLOOR_LED) \
+    FLOOR(ONE_FLOOR_TICKS,     SECOND_FLOOR_LED) \
+    FLOOR(2 * ONE_FLOOR_TICKS, THIRD_FLOOR_LED)
+
+#define FLOOR_COUNT_ENTRY(steps, led)       + 1
+#define FLOOR_POSITION_ENTRY(steps, led)    , (steps) * HALF_STEPS_PER_STEP
+#define FLOOR_LED_ENTRY(steps, led)         , (led)
+#define FLOOR_LED_MASK_ENTRY(steps, led)    | (led)
+
+#define GROUND_FLOOR                1
+#define FLOOR_COUNT                 (0 BUILDING(FLOOR_COUNT_ENTRY))
+#define TOP_FLOOR                   FLOOR_COUNT
+
+#if INPUT_COUNT > 32
+#error "BUILDING has more call buttons than readCallButtons can return"
+#endif
+#if TOP_FLOOR > 9
+#error "BUILDING has floors the one digit floor number can not show"
+#endif
+
+#define BUZZER_PPS                  _RP10R //RB10 remappable output select
+#define BUZZER_LATB                 0b0000010000000000 //RB10
+#define OC1_OUTPUT                  18 //Peripheral pin select code for OC1
+#define OC_PWM_MODE                 0b110 //Output compare PWM, no fault pin
+
+//Tunes are streams of note number and length pairs, ended by TUNE_END
+#define TUNE_END                    0xFF //Marks the end of a tune
+#define TUNE_TIME_UNIT              10 //ms per unit of note length
+#define NOTE_REST                   0 //Silence
+#define NOTE_C5                     1 //Note numbers count semitones up from C5
+#define NOTE_G5                     8
+#define NOTE_C6                     13
+#define NOTE_E6                     17
+#define NOTE_G6                     20
+#define NOTE_C7                     25
+
+//Fire alarm siren
+#define SIREN_START_PERIOD          US_TO_TICKS(1200) //Lowest pitch, 0.6ms pulses
+#define SIREN_PERIOD_STEP           4 //Period lost each pulse, 1us in ticks
+#define SIREN_PULSES                800 //Pulses in one sweep
+#define SIREN_STEP                  10 //ms each sirenTable entry is played for
+#define SIREN_STEPS                 64 //Entries in sirenTable, one whole sweep
+#define SIREN_REPEATS               4 //Number of sweeps
 
 //Seven Segment Display
-#define SEG_A                       _LATB7
-#define SEG_B                       _LATB6
-#define SEG_C                       _LATB4
-#define SEG_D                       _LATB3
-#define SEG_E                       _LATA2
-#define SEG_F                       _LATB8
-#define SEG_G                       _LATB9
-
-//Stepper motor
-#define BLACK                       _LATB1
-#define YELLOW                      _LATA1
-#define BROWN                       _LATB0
-#define ORANGE                      _LATA0
+#define SEG_A_LATB                  0b0000000010000000 //RB7
+#define SEG_B_LATB                  0b0000000001000000 //RB6
+#define SEG_C_LATB                  0b0000000000010000 //RB4
+#define SEG_D_LATB                  0b0000000000001000 //RB3
+#define SEG_E_LATA                  0b0000000000000100 //RA2
+#define SEG_F_LATB                  0b0000000100000000 //RB8
+#define SEG_G_LATB                  0b0000001000000000 //RB9
+#define SEG_LATA_MASK               SEG_E_LATA
+#define SEG_LATB_MASK               (SEG_A_LATB | SEG_B_LATB | SEG_C_LATB | \
+                                     SEG_D_LATB | SEG_F_LATB | SEG_G_LATB)
+
+//Segment bits used in glyphSegments, a lit segment is a 1
+#define SEG_A                       0b0000001
+#define SEG_B                       0b0000010
+#define SEG_C                       0b0000100
+#define SEG_D                       0b0001000
+#define SEG_E                       0b0010000
+#define SEG_F                       0b0100000
+#define SEG_G                       0b1000000
+
+//Glyphs, 0 to 15 are the hexadecimal digits
+#define GLYPH_FIRE                  0xF //'F'
+#define GLYPH_BLANK                 16
+#define GLYPH_UP                    17 //Top half square
+#define GLYPH_DOWN                  18 //Bottom half square
+#define GLYPH_DASH                  19
+#define GLYPH_COUNT                 20
+
+//Multiplexed display, the digits share the segment lines
+#define DISPLAY_DIGITS              2
+#define DISPLAY_NUMBER_DIGITS       1 /* Digits 0 up to this show the floor
+                                       * number, most significant first */
+#define DIGIT_DIRECTION             1 //Digit that shows the direction of travel
+#define DIGIT0_SELECT_LATB          0b0000100000000000 //RB11
+#define DIGIT1_SELECT_LATA          0b0000000000001000 //RA3, OSCO as port I/O
+#define DIGIT_LATA_MASK             DIGIT1_SELECT_LATA
+#define DIGIT_LATB_MASK             DIGIT0_SELECT_LATB
+#define DIGIT_MASK(digit)           (1u << (digit)) //Digit bit for animations
+
+//Animation patterns are shown from bit 0 up, a 0 bit blanks the targets
+#define FIRE_FLASH_PATTERN          0b1111100000 //Off then on, 500ms each
+#define FIRE_FLASH_STEPS            10
+#define FIRE_FLASH_STEP             100 //ms per pattern bit
+#define FIRE_FLASHES                3
+#define REFUSED_PATTERN             0b10 //Off then on, 100ms each
+#define REFUSED_STEPS               2
+#define REFUSED_STEP                100
+#define REFUSED_BLINKS              3
+
+/* Stepper motor coil bits within LATA and LATB. The coils are only written
+ * through these masks, see motorOutput. */
+#define BLACK_LATB                  0b0000000000000010 //RB1
+#define YELLOW_LATA                 0b0000000000000010 //RA1
+#define BROWN_LATB                  0b0000000000000001 //RB0
+#define ORANGE_LATA                 0b0000000000000001 //RA0
+#define COIL_LATA_MASK              (YELLOW_LATA | ORANGE_LATA)
+#define COIL_LATB_MASK              (BLACK_LATB | BROWN_LATB)
+
+//LATB bits not driven by displayScan, see TRISB for the inputs
+#define INPUT_LATB_MASK             0b0000000000100100 //RB2 and RB5
+
+#if (LED_LATB_MASK) & (SEG_LATB_MASK | DIGIT_LATB_MASK | COIL_LATB_MASK | \
+                       BUZZER_LATB | INPUT_LATB_MASK)
+#error "BUILDING gives a floor an LED on a LATB bit that is already in use"
+#endif
+
+//Stepper motor coil bits used in phaseTable
+#define COIL_BLACK                  0b0001
+#define COIL_ORANGE                 0b0010
+#define COIL_BROWN                  0b0100
+#define COIL_YELLOW                 0b1000
 
 /*******************************************************************************
         Global Variable Declarations
 *******************************************************************************/
-int currentFloorLevel = 1; /* Used to keep track of the floor that the elevator
-                           is on */
-int motorPosition = 0; /* Incremented when elevator is going up and decremented
-                        * when elevator is going down. Acts like an encoder,
-                        * recording position of the motor at all times. */
-                                            
-int motorSetpoint = ONE_FLOOR_TICKS/4; /*Used for inputting the number of cycles
-                                        *that the motor must complete into the
-                                        *elevatorUp and elevatorDown functions*/
+int currentFloorLevel = GROUND_FLOOR; /* Used to keep track of the floor
+                                       * that the elevator is on */
+
+volatile int motorPosition = 0; /* Incremented when elevator is going up and
+                                 * decremented when elevator is going down.
+                                 * Acts like an encoder, recording position of
+                                 * the motor in half steps at all times. Owned
+                                 * by the Timer4 step interrupt. */
+
+volatile int motorTarget = 0; /* The half step count that the Timer4 interrupt
+                               * is driving motorPosition towards */
 
-float buzzerDelay = 0; /* Used to vary the square wave pulse sent to the buzzer
-                        * so thatdifferent tones can be produced */
+volatile int motorMoving = 0; /* Set while the step interrupt is running and
+                               * cleared once motorPosition reaches
+                               * motorTarget */
 
-int buzzerCounter = 0; /*Controls the amount of times the buzzer sequence
-                        * is repeated */
+unsigned int rampTable[RAMP_STEPS]; /* Timer4 period for each speed level of
+                                    * the trapezoidal profile, from the
+                                    * starting speed up to the cruise speed */
+
+volatile int rampLevel = 0; /* Current speed level of the step interrupt,
+                             * used to index rampTable */
+
+volatile int motorDirection = 0; /* Direction the step interrupt is turning
+                                  * the motor, 1 for up, -1 for down and 0
+                                  * when starting from rest */
+
+int motionProfile = DEFAULT_PROFILE; //The profile rampTable was built for
+
+volatile unsigned long tripTicks = 0; /* Timer4 ticks spent on the current or
+                                       * last trip, used to compare the trip
+                                       * time of each profile */
+
+int driveMode = DEFAULT_DRIVE_MODE; //Selects the row of phaseTable in use
+
+/* Coils to energise for each drive mode, indexed by the bottom three bits of
+ * motorPosition. The full step modes move two half steps at a time, so only
+ * their even entries are normally used. */
+const unsigned char phaseTable[3][8] =
+{
+    //DRIVE_WAVE
+    {COIL_BLACK, COIL_BLACK,
+     COIL_ORANGE, COIL_ORANGE,
+     COIL_BROWN, COIL_BROWN,
+     COIL_YELLOW, COIL_YELLOW},
+
+    //DRIVE_TWO_PHASE
+    {COIL_BLACK | COIL_ORANGE, COIL_BLACK | COIL_ORANGE,
+     COIL_ORANGE | COIL_BROWN, COIL_ORANGE | COIL_BROWN,
+     COIL_BROWN | COIL_YELLOW, COIL_BROWN | COIL_YELLOW,
+     COIL_YELLOW | COIL_BLACK, COIL_YELLOW | COIL_BLACK},
+
+    //DRIVE_HALF_STEP
+    {COIL_BLACK, COIL_BLACK | COIL_ORANGE,
+     COIL_ORANGE, COIL_ORANGE | COIL_BROWN,
+     COIL_BROWN, COIL_BROWN | COIL_YELLOW,
+     COIL_YELLOW, COIL_YELLOW | COIL_BLACK}
+};
+
+/* Half steps moved per step for each drive mode, as a power of two. The half
+ * step mode moves one half step per step, the full step modes move two. */
+const int driveStepShift[3] = {1, 1, 0};
+
+unsigned int coilLatA[8]; /* LATA and LATB coil bits for each entry of the */
+unsigned int coilLatB[8]; /* current phaseTable row, see buildCoilMasks */
+
+unsigned int taskEvents[TASK_COUNT]; /* Events waiting for each task, one bit
+                                      * per event. Only the main loop uses
+                                      * these, interrupts go through a queue */
+
+/* Single producer, single consumer queues. Each queue is only added to by one
+ * interrupt, which moves queueHead on, and only emptied by the main loop,
+ * which moves queueTail on, so neither has to hold off the other. The counts
+ * run freely and are masked down to an index. */
+volatile unsigned int queueBuffer[QUEUE_COUNT][QUEUE_SIZE];
+volatile unsigned int queueHead[QUEUE_COUNT] = {0};
+volatile unsigned int queueTail[QUEUE_COUNT] = {0};
+unsigned int queueDropped = 0; //Messages lost to full queues
+
+/* Task functions, indexed by task number. The scheduler always runs the
+ * lowest numbered task that has events waiting. */
+void (*const taskTable[TASK_COUNT])(unsigned int events) =
+{
+    motionTask,
+    inputTask,
+    displayTask,
+    audioTask
+};
+
+int tripState = TRIP_IDLE; //Where the motion task is in the current trip
+
+unsigned char floorCalls[FLOOR_COUNT + 1] = {0}; /* CALL_ bits waiting at
+                                                  * each floor, cleared as the
+                                                  * car serves them */
+
+int sweepDirection = 0; /* Direction the car is serving calls in, 1 for up,
+                         * -1 for down and 0 when there are none */
+
+unsigned int travelTime[FLOOR_COUNT + 1][FLOOR_COUNT + 1]; /* ms to go from
+                                    * one floor to another, for the current
+                                    * profile and drive mode */
+
+unsigned int routeEta[FLOOR_COUNT + 1][CALL_TYPES]; /* ms from the start of
+                                    * the current leg or the end of the door
+                                    * cycle to serving each call, or ETA_NONE,
+                                    * see planRoute */
+
+int legFrom = GROUND_FLOOR; //Floor the current leg started from
+unsigned int legTime = 0; //Estimated ms for the current leg
+unsigned long departTime = 0; //systemTime at which the doors will be closed
+
+int etaFloor = GROUND_FLOOR; /* Floor and call type of the last hall call, */
+int etaType = 0;             /* whose estimate the display shows */
+
+int doorState = DOOR_CLOSED; //Where the doors are in their cycle
+unsigned int doorOpenTime = DEFAULT_DOOR_OPEN_TIME; /* Door timing in ms, set */
+unsigned int doorDwellTime = DEFAULT_DOOR_DWELL_TIME; /* by doorSetTimes */
+unsigned int doorCloseTime = DEFAULT_DOOR_CLOSE_TIME;
+unsigned int doorEarlyDwell = DEFAULT_DOOR_EARLY_DWELL;
+unsigned int doorCycleTime = DEFAULT_DOOR_OPEN_TIME + DEFAULT_DOOR_DWELL_TIME +
+                             DEFAULT_DOOR_CLOSE_TIME; /* Time spent stopped at
+                                                       * each floor */
+int doorHurried = 0; //Set once a car call has cut the dwell short
+int doorReopens = 0; //Door requests honoured at the current stop
+
+/* Hall calls made at each floor, counted in buckets of DEMAND_BUCKET_TIME. The
+ * bucket for the current period is demandPeriod % DEMAND_BUCKETS, and the
+ * oldest bucket is cleared for reuse as each period starts. */
+unsigned char demandCount[DEMAND_BUCKETS][FLOOR_COUNT + 1] = {{0}};
+unsigned long demandPeriod = 0; //systemTime / DEMAND_BUCKET_TIME last seen
+
+int holdPolicy = DEFAULT_HOLD_POLICY; //What to do with the coils when idle
+
+int holdCount = 0; /* HOLD_TICK periods of full hold left after arriving */
+
+int holdCoilsOn = 0; //Whether the held coils are on, while chopping
+
+unsigned long callButtons = 0; /* Buttons down at the last shift register
+                                * read, one bit per input */
+
+int buttonState[INPUT_COUNT] = {BUTTON_RELEASED}; //Debounce state of buttons
+int buttonSample[INPUT_COUNT]; /* Level at the last tick while settling, 1 for
+                                * pressed */
+int buttonSettle[INPUT_COUNT]; /* ms the button has to stay at buttonSample to
+                                * settle */
+                                            
+volatile unsigned long systemTime = 0; /* Milliseconds since start-up, counted
+                                        * by the Timer1 system tick */
+
+/* Software timers, hung off a hashed timing wheel. A timer that expires t ms
+ * from now sits in slot (systemTime + t) % WHEEL_SLOTS, and timerRounds counts
+ * the whole turns of the wheel that still have to pass first. Each tick only
+ * the timers in the current slot need to be looked at. */
+int wheelHead[WHEEL_SLOTS]; //First timer in each slot
+int timerNext[SOFT_TIMER_COUNT]; //Next timer in the same slot
+volatile int timerSlot[SOFT_TIMER_COUNT]; //Slot the timer is in, or TIMER_IDLE
+unsigned int timerRounds[SOFT_TIMER_COUNT]; //Wheel turns left before expiry
+unsigned int timerPeriod[SOFT_TIMER_COUNT]; //Reload in ms, 0 for one-shot
+void (*timerCallback[SOFT_TIMER_COUNT])(void); //Called when the timer expires
+
+unsigned int sirenTable[SIREN_STEPS]; /* Tone period for each SIREN_STEP of one
+                                      * siren sweep, see initializeSirenTable */
+
+/* Timer2 period of each note number, from C5 (523Hz) to C7 (2093Hz). Like the
+ * tunes below, it is kept in program memory and read through the PSV window. */
+const unsigned int notePeriods[] __attribute__((space(auto_psv))) =
+{
+    0, //NOTE_REST
+    7645, 7215, 6810, 6428, 6067, 5727, 5405, 5102, 4816, 4545, 4290, 4050,
+    3822, 3608, 3405, 3214, 3034, 2863, 2703, 2551, 2408, 2273, 2145, 2025,
+    1911
+};
+
+//Two tone chime when the car arrives at a floor
+const unsigned char arrivalTune[] __attribute__((space(auto_psv))) =
+{
+    NOTE_E6, 20,
+    NOTE_C6, 30,
+    TUNE_END
+};
 
-int counter; //Miscellaneous variable used to control 'for loops'
+//Rising pair of notes when the car sets off upwards
+const unsigned char upTune[] __attribute__((space(auto_psv))) =
+{
+    NOTE_C6, 8,
+    NOTE_REST, 2,
+    NOTE_G6, 12,
+    TUNE_END
+};
+
+//Falling pair of notes when the car sets off downwards
+const unsigned char downTune[] __attribute__((space(auto_psv))) =
+{
+    NOTE_G6, 8,
+    NOTE_REST, 2,
+    NOTE_C6, 12,
+    TUNE_END
+};
+
+//Three low beeps when a call can not be served
+const unsigned char faultTune[] __attribute__((space(auto_psv))) =
+{
+    NOTE_C5, 10,
+    NOTE_REST, 5,
+    NOTE_C5, 10,
+    NOTE_REST, 5,
+    NOTE_C5, 10,
+    TUNE_END
+};
+
+//Lit segments of each glyph
+const unsigned char glyphSegments[GLYPH_COUNT] =
+{
+    SEG_A | SEG_B | SEG_C | SEG_D | SEG_E | SEG_F,          //0
+    SEG_B | SEG_C,                                          //1
+    SEG_A | SEG_B | SEG_D | SEG_E | SEG_G,                  //2
+    SEG_A | SEG_B | SEG_C | SEG_D | SEG_G,                  //3
+    SEG_B | SEG_C | SEG_F | SEG_G,                          //4
+    SEG_A | SEG_C | SEG_D | SEG_F | SEG_G,                  //5
+    SEG_A | SEG_C | SEG_D | SEG_E | SEG_F | SEG_G,          //6
+    SEG_A | SEG_B | SEG_C,                                  //7
+    SEG_A | SEG_B | SEG_C | SEG_D | SEG_E | SEG_F | SEG_G,  //8
+    SEG_A | SEG_B | SEG_C | SEG_D | SEG_F | SEG_G,          //9
+    SEG_A | SEG_B | SEG_C | SEG_E | SEG_F | SEG_G,          //A
+    SEG_C | SEG_D | SEG_E | SEG_F | SEG_G,                  //b
+    SEG_A | SEG_D | SEG_E | SEG_F,                          //C
+    SEG_B | SEG_C | SEG_D | SEG_E | SEG_G,                  //d
+    SEG_A | SEG_D | SEG_E | SEG_F | SEG_G,                  //E
+    SEG_A | SEG_E | SEG_F | SEG_G,                          //F
+    0,                                                      //GLYPH_BLANK
+    SEG_A | SEG_B | SEG_F | SEG_G,                          //GLYPH_UP
+    SEG_C | SEG_D | SEG_E | SEG_G,                          //GLYPH_DOWN
+    SEG_G                                                   //GLYPH_DASH
+};
+
+unsigned int glyphLatA[GLYPH_COUNT]; /* LATA and LATB segment bits for each */
+unsigned int glyphLatB[GLYPH_COUNT]; /* glyph, see initializeDisplay */
+
+//Motor position of each floor in half steps, and the LED to light for it
+const int floorPositions[FLOOR_COUNT + 1] = {0 BUILDING(FLOOR_POSITION_ENTRY)};
+const unsigned int floorLeds[FLOOR_COUNT + 1] = {0 BUILDING(FLOOR_LED_ENTRY)};
+
+//Select line of each digit, a digit is lit while its line is high
+const unsigned int digitLatA[DISPLAY_DIGITS] = {0, DIGIT1_SELECT_LATA};
+const unsigned int digitLatB[DISPLAY_DIGITS] = {DIGIT0_SELECT_LATB, 0};
+
+volatile unsigned char displayGlyphs[DISPLAY_DIGITS] = {GLYPH_BLANK,
+        GLYPH_BLANK}; //Display framebuffer, the glyph on each digit
+volatile unsigned int displayLeds = 0; //and the indicator LEDs to light
+
+int scanDigit = 0; //Digit displayScan is showing
+
+int tripDirection = 0; //1 while the car travels up, -1 down, otherwise 0
+
+unsigned int animationDigits[ANIMATION_COUNT]; /* Digits and indicator LEDs */
+unsigned int animationLeds[ANIMATION_COUNT];   /* each animation blinks */
+unsigned int animationPattern[ANIMATION_COUNT]; //Shown one bit per step
+int animationSteps[ANIMATION_COUNT]; //Bits in the pattern
+unsigned int animationStepMs[ANIMATION_COUNT]; //Length of each step
+int animationRepeats[ANIMATION_COUNT]; //Patterns left to show, or FOREVER
+int animationStep[ANIMATION_COUNT]; //Bit of the pattern being shown
+unsigned int animationTime[ANIMATION_COUNT]; //ms left of the current step
+volatile int animationActive[ANIMATION_COUNT] = {0}; //Set while it runs
+
+volatile unsigned int hiddenDigits = 0; /* Digits and LEDs blanked by the */
+volatile unsigned int hiddenLeds = 0;   /* running animations */
+
+const unsigned char *tuneNext; //Next note of the tune being played
+
+int sirenIndex = 0; //Next entry of sirenTable to play
+
+int sirenRepeats = 0; //Siren sweeps still to be played
 
 /*******************************************************************************
         main() function
@@ -120,14 +728,18 @@ int counter; //Miscellaneous variable used to control 'for loops'
 int main (void)
 {
     //Initilize and configure the PIC
-    initializeTimer();
     initializePorts();
+    initializeDisplay();
+    initializeSystemTick();
+    initializeBuzzer();
+    initializeStepTimer();
     initializeInterrupt1();
 
+    postEvent(TASK_DISPLAY, EVENT_FLOOR_CHANGED);
+
     while (1)
     {
-        handleInputs();
-        updateIndicators();
+        runScheduler();
     }
 
 } //End elevatorSummative.c
@@ -154,410 +766,2977 @@ void initializePorts (void)
 }
 
 /*******************************************************************************
- * Function:    initializeTimer
+ * Function:    initializeSystemTick
  *
  * PreCondition: none
  * Input:   none
  * Output:  none
-
- * Overview:    This is intended to initialize the microcontroller so that
- *              we can generate delay
- * Note:
+ * Side Effects: none
+ *
+ * Overview: Configures Timer1 to interrupt every millisecond and empties the
+ *           timing wheel.
+ *
+ * Note: The tick runs above INT1 so that software timers keep running during
+ *       the fire alarm, but below the step interrupt.
  * ****************************************************************************/
-void initializeTimer (void)
+void initializeSystemTick (void)
 {
-    T2CON = 0;
-    T3CON = 0;
+    int i;
 
-    TMR3 = 0;
-    TMR2 = 0;
+    for (i = 0; i < WHEEL_SLOTS; i++)
+    {
+        wheelHead[i] = NO_TIMER;
+    }
+
+    for (i = 0; i < SOFT_TIMER_COUNT; i++)
+    {
+        timerSlot[i] = TIMER_IDLE;
+    }
 
-    IFS0bits.T3IF = 0;
-    T2CONbits.T32 = 1;
-    T2CONbits.TON = 1;
+    T1CON = 0; //1:1 prescaler, 4000 timer ticks per millisecond
+    TMR1 = 0;
+    PR1 = SYSTEM_TICK_PERIOD;
+
+    _T1IP = 5;
+    _T1IF = 0;
+    _T1IE = 1;
+
+    T1CONbits.TON = 1;
 }
 
 /*******************************************************************************
- * Function:    delay
+ * Function:    timerStart
  *
- * PreCondition: none
- * Input:   Number of milliseconds to delay
+ * PreCondition: initializeSystemTick must have been called
+ * Input:   The software timer to use, from 0 to SOFT_TIMER_COUNT - 1
+ *          Milliseconds until the first expiry, at least 1
+ *          Milliseconds between later expiries, or 0 to only expire once
+ *          Function to call on each expiry
  * Output:  none
- 
- * Overview:    Generate a delay in milliseconds, up to ~35minutes. Used for 
- *              many purposes, including for the stepper motor, buzzer and
- *              flashing LEDs.
- * Note:
+ * Side Effects: none
+ *
+ * Overview: Starts or restarts a software timer.
+ *
+ * Note: Callbacks run inside the Timer1 interrupt, so they must be short and
+ *       must not wait on anything.
  * ****************************************************************************/
-void delay (float milli)
+void timerStart (int timer, unsigned int delayMs, unsigned int periodMs,
+                 void (*callback)(void))
 {
-    unsigned long PeriodRegisterValue;
-
-    PeriodRegisterValue = (float) milli * 4000ul;
+    _T1IE = 0;
 
-    TMR2 = 0;
-    TMR3 = 0;
+    timerUnlink(timer);
 
-    PR3 = (unsigned int) (PeriodRegisterValue >> 16);
-    PR2 = (unsigned int) (PeriodRegisterValue & 0x0000FFFF);
+    timerPeriod[timer] = periodMs;
+    timerCallback[timer] = callback;
+    timerInsert(timer, delayMs);
 
-    while (!_T3IF == 1);
-        _T3IF = 0;
+    _T1IE = 1;
 }
 
 /*******************************************************************************
- * Function:    handleInputs
+ * Function:    timerStop
  *
  * PreCondition: none
- * Input:   none
+ * Input:   The software timer to stop
  * Output:  none
  * Side Effects: none
  *
- * Overview: This function checks whether or not the up or down buttons are
- *           pressed and moves the stepper motor accordingly. It is coded in
- *           such a way that if both buttons are pressed at the same time, or
- *           if the elevator is already at the lowest or highest level, it will
- *           not move the stepper motor or increment the requestedFloorVariable.
- *           It waits for 1 second before moving the elevator to simulate the 
- *           time it takes for passengers to get on or off.
+ * Overview: Stops a software timer so that its callback is not called again.
+ *
+ * Note: Stopping a timer that is not running does nothing.
+ * ****************************************************************************/
+void timerStop (int timer)
+{
+    _T1IE = 0;
+    timerUnlink(timer);
+    _T1IE = 1;
+}
+
+/*******************************************************************************
+ * Function:    timerRunning
+ *
+ * PreCondition: none
+ * Input:   The software timer to check
+ * Output:  1 if the timer is waiting to expire, 0 if it is stopped
+ * Side Effects: none
+ *
+ * Overview: Lets callers wait on a one-shot timer without needing a callback.
  *
  * Note:
  * ****************************************************************************/
-void handleInputs(void)
+int timerRunning (int timer)
 {
-    //If the Up button is pressed and the Down button is not pressed
-        if (UP_BUTTON == 0 && DOWN_BUTTON == 1)
-        {
-            //If the elevator is currently at either floor 1 or 2
-            if (currentFloorLevel < 3)
-            {
-                currentFloorLevel++; //Then increment the floor level
-                delay (1000);
-                elevatorUp(motorSetpoint);
+    return timerSlot[timer] != TIMER_IDLE;
+}
 
-                delay (400);
-                buzzer(700); //Buzzer signals that the floor has arrived
-            }
-        }
-        //If the Up button is not pressed and the Down button is pressed
-            else if (UP_BUTTON == 1 && DOWN_BUTTON == 0)
-            {
-                //If the elevator is currently at either floor 2 or 3
-                    if (currentFloorLevel > 1)
-                    {
-                        currentFloorLevel--; //Then decrement the floor level
-                        delay (1000);
-                        elevatorDown(motorSetpoint);
+/*******************************************************************************
+ * Function:    timeNow
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  systemTime
+ * Side Effects: none
+ *
+ * Overview: Reads systemTime from the main loop. The count takes two
+ *           instructions to read, so the tick is held off in between in case
+ *           it carries into the high word.
+ *
+ * Note: Not for use inside the Timer1 interrupt, which can read it directly.
+ * ****************************************************************************/
+unsigned long timeNow (void)
+{
+    unsigned long now;
 
-                        delay (400);
-                        buzzer(700); //Buzzer signals that the floor has arrived
-                    }
-            }
+    _T1IE = 0;
+    now = systemTime;
+    _T1IE = 1;
+
+    return now;
 }
 
 /*******************************************************************************
- * Function: segmentDisplay
+ * Function:    timerInsert
  *
- * Precondition: Floor must be reached
- * Input: Whether a particular segment should be on or off
- * Output: none
+ * PreCondition: The timer must not be in the wheel, and the Timer1 interrupt
+ *               must not be able to run
+ * Input:   The software timer, and the milliseconds until it expires
+ * Output:  none
  * Side Effects: none
  *
- * Overview: It acts like a register for each segment of the display.
- *           Able to turn on or off any segments.
+ * Overview: Hangs a timer on the front of the wheel slot it expires in. The
+ *           slot is next looked at ((delay - 1) % WHEEL_SLOTS) + 1 ticks from
+ *           now, then every WHEEL_SLOTS ticks, which sets timerRounds.
  *
- * Note: 0 is to turn on, 1 is turn off, because segments require a negative
- *       signal to turn on.
- ******************************************************************************/
-void segmentDisplay (int a, int b, int c, int d, int e, int f, int g)
+ * Note: A delay of 0 is treated as 1.
+ * ****************************************************************************/
+void timerInsert (int timer, unsigned int delayMs)
 {
-    SEG_A = a;
-    SEG_B = b;
-    SEG_C = c;
-    SEG_D = d;
-    SEG_E = e;
-    SEG_F = f;
-    SEG_G = g;
+    int slot;
+
+    if (delayMs == 0)
+    {
+        delayMs = 1;
+    }
+
+    slot = (int) ((systemTime + delayMs) & (WHEEL_SLOTS - 1));
+
+    timerRounds[timer] = (delayMs - 1) / WHEEL_SLOTS;
+    timerSlot[timer] = slot;
+    timerNext[timer] = wheelHead[slot];
+    wheelHead[slot] = timer;
 }
 
 /*******************************************************************************
- * Function:    updateIndicators
+ * Function:    timerUnlink
  *
- * PreCondition: Floor must be reached
- * Input:   none
+ * PreCondition: The Timer1 interrupt must not be able to run
+ * Input:   The software timer
  * Output:  none
  * Side Effects: none
-
- * Overview: Displays the appropriate floor level on the segment display and 
-             turns on the appropriate indicator LED.
  *
- * Note:
+ * Overview: Takes a timer out of its wheel slot and marks it as stopped.
+ *
+ * Note: Does nothing if the timer is already stopped.
  * ****************************************************************************/
-void updateIndicators(void)
+void timerUnlink (int timer)
 {
-//If first floor
-    if (currentFloorLevel == 1)
+    int slot = timerSlot[timer];
+    int *link;
+
+    if (slot == TIMER_IDLE)
     {
-        FIRST_FLOOR_LED = 1;
-        SECOND_FLOOR_LED = 0;
-        THIRD_FLOOR_LED = 0;
-        segmentDisplay(1, 0, 0, 1, 1, 1, 1); //Display a '1'
+        return;
     }
 
-    //If second floor
-        else if (currentFloorLevel == 2)
+    for (link = &wheelHead[slot]; *link != NO_TIMER; link = &timerNext[*link])
+    {
+        if (*link == timer)
         {
-            FIRST_FLOOR_LED = 0;
-            SECOND_FLOOR_LED = 1;
-            THIRD_FLOOR_LED = 0;
-            segmentDisplay(0, 0, 1, 0, 0, 1, 0); //Display a '2'
+            *link = timerNext[timer];
+            break;
         }
+    }
 
-    //If third floor
-        else if (currentFloorLevel == 3)
-        {
-            FIRST_FLOOR_LED = 0;
-            SECOND_FLOOR_LED = 0;
-            THIRD_FLOOR_LED = 1;
-            segmentDisplay(0, 0, 0, 0, 1, 1, 0); //Display a '3'
-        }
+    timerSlot[timer] = TIMER_IDLE;
 }
 
 /*******************************************************************************
- * Function:    elevatorUp
+ * Function:    _T1Interrupt
  *
- * PreCondition: Up button must be pressed and floor level must be less than 3
- * Input: The number of 4-step cycles to complete
- * Output: none
- * Side Effects: none
+ * PreCondition: initializeSystemTick must have been called
+ * Input:   none
+ * Output:  none
+ * Side Effects: Calls the callbacks of expired software timers
  *
- * Overview: Turns the stepper motor for the desired number of cycles
+ * Overview: Counts systemTime, debounces any buttons that have changed,
+ *           steps the display animations, moves the display on to its next
+ *           digit and turns the timing wheel by one slot. Timers in
+ *           the slot that still have rounds to go are counted down, the rest
+ *           are taken out of the wheel. Periodic timers are put back for their
+ *           next expiry and then every expired callback is called.
  *
- * Note:
+ * Note: Expired timers are collected before any callback runs, so callbacks
+ *       are free to start and stop timers, including their own.
  * ****************************************************************************/
-void elevatorUp (int cycles)
+void __attribute__((interrupt,no_auto_psv)) _T1Interrupt (void)
 {
-    for (counter = 0; counter < cycles; counter++)
+    unsigned int expired = 0; //One bit per software timer
+    int *link;
+    int timer;
+
+    _T1IF = 0;
+
+    systemTime++;
+
+    buttonTick();
+    animationTick();
+    displayScan();
+
+    link = &wheelHead[systemTime & (WHEEL_SLOTS - 1)];
+    while (*link != NO_TIMER)
+    {
+        timer = *link;
+
+        if (timerRounds[timer] > 0)
+        {
+            timerRounds[timer]--;
+            link = &timerNext[timer];
+        }
+        else
+        {
+            *link = timerNext[timer];
+            timerSlot[timer] = TIMER_IDLE;
+            expired |= 1u << timer;
+        }
+    }
+
+    for (timer = 0; expired != 0; timer++, expired >>= 1)
     {
+        if (expired & 1)
+        {
+            if (timerPeriod[timer] != 0)
+            {
+                timerInsert(timer, timerPeriod[timer]);
+            }
+            timerCallback[timer]();
+        }
+    }
+}
 
-        BLACK = 0;
-        YELLOW = 0;
-        BROWN = 0;
-        ORANGE = 1;
-        delay(MOTOR_DELAY);
-        motorPosition++; //Increment the motor position for each step travelled
+/*******************************************************************************
+ * Function:    runScheduler
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: Runs one task
+ *
+ * Overview: Collects the events queued by the interrupts, then runs the
+ *           highest priority task that has events waiting, passing it all of
+ *           its events at once. Every task runs to completion and
+ *           never waits, so a new event is handled within one task run of
+ *           being posted. When no task has anything to do the CPU idles until
+ *           the next interrupt.
+ *
+ * Note: An event posted just before idling is picked up at the next interrupt,
+ *       which is at most one system tick later.
+ * ****************************************************************************/
+void runScheduler (void)
+{
+    unsigned int events;
+    int task;
 
-        BLACK = 0;
-        YELLOW = 0;
-        BROWN = 1;
-        ORANGE = 0;
-        delay(MOTOR_DELAY);
-        motorPosition++;
+    collectEvents();
 
-        BLACK = 0;
-        YELLOW = 1;
-        BROWN = 0;
-        ORANGE = 0;
-        delay(MOTOR_DELAY);
-        motorPosition++;
+    for (task = 0; task < TASK_COUNT; task++)
+    {
+        events = takeEvents(task);
 
-        BLACK = 1;
-        YELLOW = 0;
-        BROWN = 0;
-        ORANGE = 0;
-        delay(MOTOR_DELAY);
-        motorPosition++;
+        if (events != 0)
+        {
+            taskTable[task](events);
+            return;
+        }
     }
+
+    asm("PWRSAV #1"); //Idle mode, the timers and interrupts keep running
 }
 
 /*******************************************************************************
- * Function:    elevatorDown
+ * Function:    postEvent
  *
- * PreCondition: Down button must be pressed and floor level must be greater
- *               than 1
- * Input:   The number of 4 step cycles to complete
+ * PreCondition: none
+ * Input:   The task to send the events to, and the event bits
  * Output:  none
  * Side Effects: none
  *
- * Overview: Each loop is 4 steps so the input is the number of cycles the motor
- *           needs to move.
- * Note:
+ * Overview: Marks events as waiting for a task. Events that are already
+ *           waiting are merged, so each one is handled once.
+ *
+ * Note: Only called from the main loop, interrupts use signalEvent.
  * ****************************************************************************/
-void elevatorDown (int cycles)
+void postEvent (int task, unsigned int events)
 {
-    for (counter = 0; counter < cycles; counter++)
-    {
-        BLACK = 1;
-        YELLOW = 0;
-        BROWN = 0;
-        ORANGE = 0;
-        delay(MOTOR_DELAY);
-        motorPosition--; //Decrement the motor position for each step travelled
+    taskEvents[task] |= events;
+}
+
+/*******************************************************************************
+ * Function:    takeEvents
+ *
+ * PreCondition: none
+ * Input:   The task to collect events for
+ * Output:  The events that were waiting
+ * Side Effects: Clears the waiting events
+ *
+ * Overview: Reads and clears the events waiting for a task.
+ *
+ * Note: Only called from the main loop.
+ * ****************************************************************************/
+unsigned int takeEvents (int task)
+{
+    unsigned int events = taskEvents[task];
 
-        BLACK = 0;
-        YELLOW = 1;
-        BROWN = 0;
-        ORANGE = 0;
-        delay(MOTOR_DELAY);
-        motorPosition--;
+    taskEvents[task] = 0;
 
-        BLACK = 0;
-        YELLOW = 0;
-        BROWN = 1;
-        ORANGE = 0;
-        delay(MOTOR_DELAY);
-        motorPosition--;
+    return events;
+}
+
+/*******************************************************************************
+ * Function:    queuePut
+ *
+ * PreCondition: none
+ * Input:   The queue, and the message to add to it
+ * Output:  1 if the message was added, 0 if the queue was full
+ * Side Effects: Counts dropped messages in queueDropped
+ *
+ * Overview: Adds a message to the end of a queue. The message is stored
+ *           before queueHead is moved on, so the main loop never sees a slot
+ *           that has not been written.
+ *
+ * Note: Each queue must only ever be added to by one interrupt.
+ * ****************************************************************************/
+int queuePut (int queue, unsigned int message)
+{
+    unsigned int head = queueHead[queue];
 
-        BLACK = 0;
-        YELLOW = 0;
-        BROWN = 0;
-        ORANGE = 1;
-        delay(MOTOR_DELAY);
-        motorPosition--;
+    if (head - queueTail[queue] == QUEUE_SIZE)
+    {
+        queueDropped++;
+        return 0;
     }
+
+    queueBuffer[queue][head & (QUEUE_SIZE - 1)] = message;
+    queueHead[queue] = head + 1;
+
+    return 1;
 }
 
 /*******************************************************************************
- * Function:   initializeInterrupt
+ * Function:    queueGet
  *
  * PreCondition: none
- * Input:   none
- * Output:  none
+ * Input:   The queue, and where to store the message
+ * Output:  1 if a message was taken, 0 if the queue is empty
  * Side Effects: none
  *
- * Overview: Configures RB2 on the PIC to be used as an interrupt
+ * Overview: Takes the oldest message from a queue.
  *
- * Note:
+ * Note: Only called from the main loop.
  * ****************************************************************************/
-void initializeInterrupt1 (void)//Initializing Interrupt 1
+int queueGet (int queue, unsigned int *message)
 {
-    /* Initialize Input Interrupt Switch (AN4/RP2/RB2) for use as a fire alarm
-     * switch */
+    unsigned int tail = queueTail[queue];
 
-_INT1R = 2; //Assign INT1 input function to RP2 (RB2)
-	
-_INT1EP = 1; /* Interrupt INT1 on negative edge (when button is pressed,
-              * it returns a '0') */
-	
-_INT1IF = 0; //Clear INT1 flag
-	
-_INT1IE = 1; //Enable INT1 interrupt
+    if (tail == queueHead[queue])
+    {
+        return 0;
+    }
 
-}//end initializeInterrupt1
+    *message = queueBuffer[queue][tail & (QUEUE_SIZE - 1)];
+    queueTail[queue] = tail + 1;
+
+    return 1;
+}
 
 /*******************************************************************************
- * Function:    interrupt
+ * Function:    signalEvent
  *
- * PreCondition: Interrupt button (Fire alarm) must be pressed
- * Input:   none
+ * PreCondition: none
+ * Input:   The interrupt's queue, the task to send the events to, and the
+ *          event bits
  * Output:  none
- * Side Effects:
+ * Side Effects: none
  *
- * Overview: Flashes the Fire alarm LED and the letter 'F' three times. Then the
- *	     elevator is moved down to the ground floor. PIC is then reset.
+ * Overview: Sends events to a task from an interrupt. The scheduler picks
+ *           them up from the queue before it next runs a task. Events are
+ *           bits, so an identical message that is still waiting in the queue
+ *           already covers this one and nothing more is queued. However long
+ *           the main loop is held up, a queue never fills with repeats of the
+ *           same timer event.
  *
- * Note:
+ * Note: Never holds off other interrupts. The main loop cannot run during
+ *       the search, and a message it has read but not yet taken off the
+ *       queue is still posted afterwards.
  * ****************************************************************************/
-void __attribute__((interrupt,no_auto_psv)) _INT1Interrupt (void) //ISR
+void signalEvent (int queue, int task, unsigned int events)
 {
-    //Clear INT1 flag after an interrupt has been initiated
-    //which resets the entire process
-    _INT1IF = 0;
+    unsigned int message = EVENT_MESSAGE(task, events);
+    unsigned int head = queueHead[queue];
+    unsigned int slot;
 
-    //Seven segment display is cleared and the indicator LEDs are turned off
-        FIRST_FLOOR_LED = 0;
-        SECOND_FLOOR_LED = 0;
-        THIRD_FLOOR_LED = 0;
-        segmentDisplay(1, 1, 1, 1, 1, 1, 1);
-
-    delay (300);
-    
-   /* Flashes the letter 'F' on the segment display and the fire alarm indicator
-    * LED in sync three times. */
-       for (counter = 0; counter < 3; counter++)
-       {
-            FIRE_ALARM_LED  = 0;
-            segmentDisplay(1, 1, 1, 1, 1, 1, 1);
-            delay (500);
-
-            FIRE_ALARM_LED = 1;
-            segmentDisplay(0, 1, 1, 1, 0, 0, 0);
-            delay (500);
-        }
-
-    fireAlarm(); //Buzzer is sounded
-
-    motorSetpoint = motorPosition/4; /* The number of steps down to the ground
-                                      * floor is the current motor position
-				      * It is divided by four to get the number
-                                      * of cycles */
-    
-    elevatorDown(motorSetpoint); //Elevator is sent to ground floor
-
-    asm("RESET"); /* Resets the PIC so that it doesn't go back to what it was
-                   * doing before after interrupt is over */
-}//end _INT1Interrupt
+    for (slot = queueTail[queue]; slot != head; slot++)
+    {
+        if (queueBuffer[queue][slot & (QUEUE_SIZE - 1)] == message)
+        {
+            return;
+        }
+    }
+
+    queuePut(queue, message);
+}
 
 /*******************************************************************************
- * Function:    buzzer
+ * Function:    collectEvents
  *
- * PreCondition: Floor must be reached or fire alarm button must be pressed for 
- *		 buzzer to activate
- * Input:   End condition of for loop, controls how long buzzer runs
+ * PreCondition: none
+ * Input:   none
  * Output:  none
- * Side Effects: none
+ * Side Effects: Marks the queued events as waiting
  *
- * Overview: Pulses a signal to the piezo buzzer to turn it on
+ * Overview: Empties the task event queues of every interrupt into taskEvents.
  *
- * Note: Length inputted is just a rough indication of the time that the buzzer
- *       will run, not directly a time unit.
+ * Note: QUEUE_BUTTONS holds button events, which the input task takes itself.
  * ****************************************************************************/
-void buzzer (int length)
+void collectEvents (void)
 {
-    for (counter = 0; counter < length; counter++)
+    unsigned int message;
+    int queue;
+
+    for (queue = 0; queue < QUEUE_COUNT; queue++)
     {
-        BUZZER = 1;
-        delay (0.3);
+        if (queue == QUEUE_BUTTONS)
+        {
+            continue;
+        }
 
-        BUZZER = 0;
-        delay (0.3);
+        while (queueGet(queue, &message))
+        {
+            postEvent(MESSAGE_TASK(message), MESSAGE_EVENTS(message));
+        }
     }
 }
 
 /*******************************************************************************
- * Function:    fireAlarm
+ * Function:    motionTask
  *
- * PreCondition: fire alarm button must be pressed for buzzer to activate
- * Input:   none
+ * PreCondition: none
+ * Input:   The events waiting for the task
  * Output:  none
- * Side Effects: none
+ * Side Effects: Changes tripState, tripDirection, sweepDirection,
+ *               currentFloorLevel, floorCalls and the motor target
  *
- * Overview: Pulses a signal to the piezo buzzer to turn it on. The delay starts
- *           out at 0.6 and is decremented so that the pitch increases steadily.
- *           This sequence is repeated four times.
+ * Overview: Serves the calls in floorCalls. A call while idle sends the car
+ *           straight to the stop picked by lookNextStop. A call while moving
+ *           becomes the new stop if it is on the way and the car can still
+ *           stop there, and the old stop is served afterwards. Once the step
+ *           interrupt reports the arrival, the doors are cycled by TIMER_TRIP
+ *           and the car leaves for the next stop as soon as they are closed.
+ *           A car call while the doors are open closes them early, and a
+ *           press for the floor the car is at opens them again. A car left
+ *           idle for PARK_DELAY is parked at the floor picked by parkFloor.
+ *           The arrival estimates are planned again after every change.
  *
- * Note: Decrementing the delay increases pitch because the time for each pulse
- *       is decreased so the piezoelectric material vibrates faster.
- *       Vice-versa is also true. 
+ * Note: currentFloorLevel is the stop the car is going to, or the floor it
+ *       is on when stopped. The fire alarm takes over from any trip, sends
+ *       the car down and resets the PIC once the alarm is over.
  * ****************************************************************************/
-void fireAlarm (void)
+void motionTask (unsigned int events)
 {
-    //Distinct fire alarm sound is repreated 4 times
-        for (buzzerCounter = 0; buzzerCounter < 4; buzzerCounter++)
+    int floor;
+    unsigned char served;
+
+    if (events & EVENT_FIRE)
+    {
+        tripState = TRIP_FIRE;
+        tripDirection = 0;
+        elevatorGoTo(GROUND_FLOOR); //Elevator is sent down straight away
+        timerStart(TIMER_TRIP, FIRE_POLL, FIRE_POLL, tripTimerExpired);
+        return;
+    }
+
+    if (tripState == TRIP_FIRE)
+    {
+        //Reset once the car is down and the siren and flashing are over
+        if (!motorMoving && !timerRunning(TIMER_SIREN) &&
+            !animationRunning(ANIMATION_FIRE))
         {
-            buzzerDelay = 0.6; //Sound starts out low pitched
+            asm("RESET"); /* Resets the PIC so that it doesn't go back to what
+                           * it was doing before the fire alarm */
+        }
+        return;
+    }
 
-            for (counter = 0; counter < 800; counter++)
-            {
-                BUZZER = 1;
-                delay (buzzerDelay);
+    if ((events & EVENT_ARRIVED) && tripState == TRIP_MOVING)
+    {
+        serveCalls(floorCalls, currentFloorLevel, sweepDirection);
+
+        tripState = TRIP_DOORS;
+        tripDirection = 0;
+        doorReopens = 0;
+        postEvent(TASK_DISPLAY, EVENT_FLOOR_CHANGED);
+        doorOpen();
+    }
+
+    //A parked car stays shut unless someone is waiting there
+    if ((events & EVENT_ARRIVED) && tripState == TRIP_PARKING)
+    {
+        tripDirection = 0;
+        postEvent(TASK_DISPLAY, EVENT_FLOOR_CHANGED);
+
+        //Serve the calls made here while parking, the way the car will leave
+        floor = lookNextStop(floorCalls, currentFloorLevel, 0);
+        if (floor == 0)
+        {
+            served = floorCalls[currentFloorLevel];
+            floorCalls[currentFloorLevel] = 0;
+        }
+        else
+        {
+            served = serveCalls(floorCalls, currentFloorLevel,
+                                (floor > currentFloorLevel) ? 1 : -1);
+        }
+
+        if (served != 0)
+        {
+            tripState = TRIP_DOORS;
+            doorReopens = 0;
+            doorOpen();
+        }
+        else
+        {
+            tripState = TRIP_IDLE;
+            tripDepart();
+        }
+    }
 
-                BUZZER = 0;
-                delay (buzzerDelay);
+    if ((events & EVENT_DOOR_REQUEST) && doorRequest() == 0)
+    {
+        postEvent(TASK_AUDIO, EVENT_FAULT);
+        postEvent(TASK_DISPLAY, EVENT_REFUSED);
+    }
 
-                buzzerDelay -= 0.0005;
+    if (events & EVENT_CALL)
+    {
+        if (tripState == TRIP_IDLE)
+        {
+            tripDepart();
+        }
+        else if (tripState == TRIP_DOORS && (events & EVENT_CAR_CALL))
+        {
+            doorHurry();
+        }
+        else if ((tripState == TRIP_MOVING || tripState == TRIP_PARKING) &&
+                 motorPosition != motorTarget)
+        {
+            /* Stop on the way for a call that is nearer than the current
+             * stop. A parking car takes any call ahead as a trip, calls
+             * behind it are picked up once it is parked. Once the car has
+             * reached its stop it is left to arrive there. */
+            floor = stopAhead(floorCalls, motorPosition, tripDirection, 1);
+
+            if (floor != 0 && (floor != currentFloorLevel ||
+                               tripState == TRIP_PARKING) &&
+                motionRetarget(floorPosition(floor)))
+            {
+                tripState = TRIP_MOVING;
+                sweepDirection = tripDirection;
+                currentFloorLevel = floor;
+                legTime = travelTime[legFrom][currentFloorLevel];
+                postEvent(TASK_DISPLAY, EVENT_FLOOR_CHANGED);
             }
         }
+    }
+
+    if ((events & EVENT_TRIP_TIMER) && tripState == TRIP_DOORS)
+    {
+        doorStep();
+    }
+
+    if ((events & EVENT_PARK_TIMER) && tripState == TRIP_IDLE)
+    {
+        tripPark();
+    }
+
+    planRoute();
+}
+
+/*******************************************************************************
+ * Function:    inputTask
+ *
+ * PreCondition: none
+ * Input:   The events waiting for the task
+ * Output:  none
+ * Side Effects: May post EVENT_CALL or EVENT_DOOR_REQUEST to the motion task
+ *
+ * Overview: This function takes the button events from QUEUE_BUTTONS and
+ *           registers a car or hall call for each press. A car press, or a
+ *           hall press the way the car will leave, at the floor the car is
+ *           standing at asks for the doors instead, see registerCall. Hall
+ *           presses are also counted for the parking policy, and the display
+ *           is asked to show when the car will get there.
+ *
+ * Note: Runs when the Timer1 interrupt has queued button events. Releases
+ *       are taken off the queue but do nothing.
+ * ****************************************************************************/
+void inputTask (unsigned int events)
+{
+    unsigned int event;
+    int input;
+    int floor;
+    unsigned char call;
+
+    if (!(events & EVENT_BUTTON))
+    {
+        return;
+    }
+
+    while (queueGet(QUEUE_BUTTONS, &event))
+    {
+        input = event & BUTTON_EVENT_BUTTON;
+
+        if ((event & BUTTON_EVENT_RELEASE) || tripState == TRIP_FIRE)
+        {
+            continue;
+        }
+
+        if (input < INPUT_HALL_UP(GROUND_FLOOR))
+        {
+            floor = input - INPUT_CAR(GROUND_FLOOR) + GROUND_FLOOR;
+            call = CALL_CAR;
+        }
+        else if (input < INPUT_HALL_DOWN(GROUND_FLOOR + 1))
+        {
+            floor = input - INPUT_HALL_UP(GROUND_FLOOR) + GROUND_FLOOR;
+            call = CALL_UP;
+        }
+        else
+        {
+            floor = input - INPUT_HALL_DOWN(GROUND_FLOOR + 1) +
+                    GROUND_FLOOR + 1;
+            call = CALL_DOWN;
+        }
+
+        if (call != CALL_CAR)
+        {
+            demandRecord(floor);
+        }
+
+        if (registerCall(floor, call) == 0)
+        {
+            postEvent(TASK_MOTION, EVENT_DOOR_REQUEST);
+        }
+        else if (call == CALL_CAR)
+        {
+            postEvent(TASK_MOTION, EVENT_CALL | EVENT_CAR_CALL);
+        }
+        else
+        {
+            etaFloor = floor;
+            etaType = (call == CALL_UP) ? 1 : 2; //The call bit is 1 << type
+            postEvent(TASK_MOTION, EVENT_CALL);
+            postEvent(TASK_DISPLAY, EVENT_ETA);
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function:    displayTask
+ *
+ * PreCondition: none
+ * Input:   The events waiting for the task
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Updates the indicators whenever the floor or the direction of
+ *           travel changes, rather than on every pass of the main loop, and
+ *           starts the blinking for refused presses and the fire alarm. When
+ *           a hall call is made, the seconds until the car gets there are
+ *           shown in place of the floor number for ETA_SHOW_TIME, with a dash
+ *           on the direction digit so it is not read as a floor.
+ *
+ * Note: The fire alarm display is kept until the PIC is reset. The motion
+ *       task runs first, so the route has already been planned for the new
+ *       call when the estimate is read.
+ * ****************************************************************************/
+void displayTask (unsigned int events)
+{
+    unsigned int eta;
+
+    if ((events & EVENT_FLOOR_CHANGED) && tripState != TRIP_FIRE)
+    {
+        updateIndicators();
+    }
+
+    //"Arriving in N s", rounded up so that 0 only shows for a car already there
+    if ((events & EVENT_ETA) && tripState != TRIP_FIRE)
+    {
+        eta = callEta(etaFloor, etaType);
+
+        if (eta != ETA_NONE)
+        {
+            eta = (eta + 999) / 1000;
+            displaySetNumber((eta > ETA_MAX_SECONDS) ? ETA_MAX_SECONDS : eta);
+            displaySetGlyph(DIGIT_DIRECTION, GLYPH_DASH);
+            timerStart(TIMER_ETA, ETA_SHOW_TIME, 0, etaTimerExpired);
+        }
+    }
+
+    if (events & EVENT_REFUSED)
+    {
+        animationStart(ANIMATION_STATUS, DIGIT_MASK(0), 0, REFUSED_PATTERN,
+                       REFUSED_STEPS, REFUSED_STEP, REFUSED_BLINKS);
+    }
+
+    /* Flashes the letter 'F' on the segment display and the fire alarm
+     * indicator LED in sync three times, with the floor LEDs turned off */
+    if (events & EVENT_ALARM)
+    {
+        animationStop(ANIMATION_STATUS);
+        displaySetLeds(FIRE_ALARM_LED);
+        displaySetGlyph(0, GLYPH_FIRE);
+        displaySetGlyph(DIGIT_DIRECTION, GLYPH_DOWN);
+        animationStart(ANIMATION_FIRE, DIGIT_MASK(0), FIRE_ALARM_LED,
+                       FIRE_FLASH_PATTERN, FIRE_FLASH_STEPS, FIRE_FLASH_STEP,
+                       FIRE_FLASHES);
+    }
+}
+
+/*******************************************************************************
+ * Function:    audioTask
+ *
+ * PreCondition: none
+ * Input:   The events waiting for the task
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Starts the tune for each event. The notes are played by OC1 and
+ *           stepped by TIMER_TUNE, so the task returns straight away.
+ *
+ * Note: A new tune replaces one that is still playing. If several events
+ *       arrive together the most important one is played. Nothing can cut
+ *       the siren short once the fire alarm has gone off.
+ * ****************************************************************************/
+void audioTask (unsigned int events)
+{
+    if (events & EVENT_SIREN)
+    {
+        fireAlarm();
+        return;
+    }
+
+    if (tripState == TRIP_FIRE)
+    {
+        return; //Leave the siren playing
+    }
+
+    if (events & EVENT_FAULT)
+    {
+        playTune(faultTune);
+    }
+    else if (events & EVENT_CHIME)
+    {
+        playTune(arrivalTune);
+    }
+    else if (events & EVENT_DEPART_UP)
+    {
+        playTune(upTune);
+    }
+    else if (events & EVENT_DEPART_DOWN)
+    {
+        playTune(downTune);
+    }
+}
+
+/*******************************************************************************
+ * Function:    tripTimerExpired
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: TIMER_TRIP callback, tells the motion task that the current door
+ *           phase is over, or that it is time to check on the fire descent.
+ *
+ * Note: Runs inside the Timer1 interrupt.
+ * ****************************************************************************/
+void tripTimerExpired (void)
+{
+    signalEvent(QUEUE_TICK, TASK_MOTION, EVENT_TRIP_TIMER);
+}
+
+/*******************************************************************************
+ * Function:    tripDepart
+ *
+ * PreCondition: The car must be stopped with the doors closed
+ * Input:   none
+ * Output:  none
+ * Side Effects: Changes tripState, tripDirection, sweepDirection and
+ *               currentFloorLevel, and may start the step interrupt
+ *
+ * Overview: Sends the car to the stop picked by lookNextStop, or leaves it
+ *           idle if there are no calls waiting.
+ *
+ * Note: An idle car is parked once TIMER_PARK expires, unless a call comes
+ *       first.
+ * ****************************************************************************/
+void tripDepart (void)
+{
+    int floor = lookNextStop(floorCalls, currentFloorLevel, sweepDirection);
+
+    if (floor == 0)
+    {
+        tripState = TRIP_IDLE;
+        sweepDirection = 0;
+        timerStart(TIMER_PARK, PARK_DELAY, 0, parkTimerExpired);
+        return;
+    }
+
+    tripState = TRIP_MOVING;
+    legFrom = currentFloorLevel;
+    legTime = travelTime[legFrom][floor];
+    currentFloorLevel = floor;
+    tripDirection = (floorPosition(currentFloorLevel) > motorPosition) ? 1 : -1;
+    sweepDirection = tripDirection;
+    postEvent(TASK_AUDIO, (tripDirection > 0) ?
+              EVENT_DEPART_UP : EVENT_DEPART_DOWN);
+    postEvent(TASK_DISPLAY, EVENT_FLOOR_CHANGED);
+    elevatorGoTo(currentFloorLevel);
+}
+
+/*******************************************************************************
+ * Function:    tripPark
+ *
+ * PreCondition: The car must be idle
+ * Input:   none
+ * Output:  none
+ * Side Effects: Changes tripState, tripDirection and currentFloorLevel, and
+ *               may start the step interrupt
+ *
+ * Overview: Moves the idle car to the floor picked by parkFloor, without
+ *           the departure tune or opening the doors when it gets there.
+ *
+ * Note: Does nothing if the car is already parked at the best floor.
+ * ****************************************************************************/
+void tripPark (void)
+{
+    int floor = parkFloor();
+
+    if (floor == currentFloorLevel)
+    {
+        return;
+    }
+
+    tripState = TRIP_PARKING;
+    legFrom = currentFloorLevel;
+    legTime = travelTime[legFrom][floor];
+    currentFloorLevel = floor;
+    tripDirection = (floorPosition(currentFloorLevel) > motorPosition) ? 1 : -1;
+    postEvent(TASK_DISPLAY, EVENT_FLOOR_CHANGED);
+    elevatorGoTo(currentFloorLevel);
+}
+
+/*******************************************************************************
+ * Function:    parkTimerExpired
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: TIMER_PARK callback, tells the motion task that the car has been
+ *           idle for PARK_DELAY.
+ *
+ * Note: Runs inside the Timer1 interrupt.
+ * ****************************************************************************/
+void parkTimerExpired (void)
+{
+    signalEvent(QUEUE_TICK, TASK_MOTION, EVENT_PARK_TIMER);
+}
+
+/*******************************************************************************
+ * Function:    etaTimerExpired
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: TIMER_ETA callback, puts the floor number and direction back on
+ *           the display once an arrival estimate has been shown for
+ *           ETA_SHOW_TIME.
+ *
+ * Note: Runs inside the Timer1 interrupt.
+ * ****************************************************************************/
+void etaTimerExpired (void)
+{
+    signalEvent(QUEUE_TICK, TASK_DISPLAY, EVENT_FLOOR_CHANGED);
+}
+
+/*******************************************************************************
+ * Function:    doorOpen
+ *
+ * PreCondition: The car must be stopped at a floor
+ * Input:   none
+ * Output:  none
+ * Side Effects: Changes doorState and departTime
+ *
+ * Overview: Starts the doors opening, from closed or from part way through
+ *           closing, and starts TIMER_TRIP for the opening time.
+ *
+ * Note: The doors are not driven by anything yet, only timed.
+ * ****************************************************************************/
+void doorOpen (void)
+{
+    doorState = DOOR_OPENING;
+    doorHurried = 0;
+    departTime = timeNow() + doorCycleTime;
+    timerStart(TIMER_TRIP, doorOpenTime, 0, tripTimerExpired);
+}
+
+/*******************************************************************************
+ * Function:    doorStep
+ *
+ * PreCondition: TIMER_TRIP must have expired while tripState is TRIP_DOORS
+ * Input:   none
+ * Output:  none
+ * Side Effects: Changes doorState and departTime
+ *
+ * Overview: Moves the doors on to their next state. The chime sounds once
+ *           the doors are open, and the car departs once they are closed.
+ *
+ * Note:
+ * ****************************************************************************/
+void doorStep (void)
+{
+    unsigned int dwell;
+
+    if (doorState == DOOR_OPENING)
+    {
+        dwell = doorHurried ? doorEarlyDwell : doorDwellTime;
+
+        doorState = DOOR_OPEN;
+        departTime = timeNow() + dwell + doorCloseTime;
+        postEvent(TASK_AUDIO, EVENT_CHIME); //Signal that the floor has arrived
+        timerStart(TIMER_TRIP, dwell, 0, tripTimerExpired);
+    }
+    else if (doorState == DOOR_OPEN)
+    {
+        doorState = DOOR_CLOSING;
+        departTime = timeNow() + doorCloseTime;
+        timerStart(TIMER_TRIP, doorCloseTime, 0, tripTimerExpired);
+    }
+    else if (doorState == DOOR_CLOSING)
+    {
+        doorState = DOOR_CLOSED;
+        tripDepart();
+    }
+}
+
+/*******************************************************************************
+ * Function:    doorRequest
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  0 if the request is refused, else 1
+ * Side Effects: Changes tripState, doorState and doorReopens
+ *
+ * Overview: Answers a car press, or a hall press the way the car will leave,
+ *           at the floor the car is stopped at. An idle car opens its doors,
+ *           closing doors open again and open doors start their dwell again.
+ *           Doors that are already opening carry on. A hall press the other
+ *           way never gets here, it is registered as a call and leaves the
+ *           doors alone.
+ *
+ * Note: Only DOOR_MAX_REOPENS requests are honoured at each stop, after
+ *       which the doors close so that the other calls are not held up.
+ * ****************************************************************************/
+int doorRequest (void)
+{
+    if (tripState == TRIP_IDLE)
+    {
+        tripState = TRIP_DOORS;
+        doorReopens = 0;
+        doorOpen();
+        return 1;
+    }
+
+    //registerCall only asks an idle car or one with its doors cycling
+    if (tripState != TRIP_DOORS || doorState == DOOR_OPENING)
+    {
+        return 1;
+    }
+
+    if (doorReopens >= DOOR_MAX_REOPENS)
+    {
+        return 0;
+    }
+
+    doorReopens++;
+
+    if (doorState == DOOR_CLOSING)
+    {
+        doorOpen();
+    }
+    else
+    {
+        doorHurried = 0;
+        departTime = timeNow() + doorDwellTime + doorCloseTime;
+        timerStart(TIMER_TRIP, doorDwellTime, 0, tripTimerExpired);
+    }
+
+    return 1;
+}
+
+/*******************************************************************************
+ * Function:    doorHurry
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: Changes departTime
+ *
+ * Overview: Cuts the dwell down to doorEarlyDwell once a car call shows that
+ *           the passengers are on board. Doors that are still opening use the
+ *           shorter dwell when they get there.
+ *
+ * Note: Never makes the dwell longer than it already was.
+ * ****************************************************************************/
+void doorHurry (void)
+{
+    unsigned long now;
+
+    doorHurried = 1;
+
+    if (doorState != DOOR_OPEN)
+    {
+        return;
+    }
+
+    now = timeNow();
+
+    if (departTime > now + doorEarlyDwell + doorCloseTime)
+    {
+        departTime = now + doorEarlyDwell + doorCloseTime;
+        timerStart(TIMER_TRIP, doorEarlyDwell, 0, tripTimerExpired);
+    }
+}
+
+/*******************************************************************************
+ * Function:    doorSetTimes
+ *
+ * PreCondition: none
+ * Input:   ms for the doors to open, the normal dwell, ms for the doors to
+ *          close, and the dwell left once a car call is made
+ * Output:  none
+ * Side Effects: Changes doorCycleTime
+ *
+ * Overview: Sets the door timing used for the following door phases and for
+ *           the arrival estimates.
+ *
+ * Note: Every time must be at least 1ms. A phase already running keeps the
+ *       time it was started with.
+ * ****************************************************************************/
+void doorSetTimes (unsigned int openMs, unsigned int dwellMs,
+                   unsigned int closeMs, unsigned int earlyMs)
+{
+    doorOpenTime = openMs;
+    doorDwellTime = dwellMs;
+    doorCloseTime = closeMs;
+    doorEarlyDwell = earlyMs;
+    doorCycleTime = openMs + dwellMs + closeMs;
+    planRoute();
+}
+
+/*******************************************************************************
+ * Function:    readCallButtons
+ *
+ * PreCondition: No digit of the display may be selected
+ * Input:   none
+ * Output:  The buttons that are down, one bit per input
+ * Side Effects: Changes the SEG_A and SEG_B lines
+ *
+ * Overview: Loads the call buttons into the shift registers, then clocks
+ *           them in one at a time.
+ *
+ * Note: The clock and load lines are changed with single bit writes, which
+ *       the step interrupt cannot split.
+ * ****************************************************************************/
+unsigned long readCallButtons (void)
+{
+    unsigned long pressed = 0;
+    int input;
+
+    SHIFT_CLOCK = 0;
+    SHIFT_LOAD = 0;
+    SHIFT_LOAD = 1;
+
+    for (input = 0; input < INPUT_COUNT; input++)
+    {
+        if (SHIFT_DATA == 0)
+        {
+            pressed |= 1ul << input;
+        }
+
+        SHIFT_CLOCK = 1;
+        SHIFT_CLOCK = 0;
+    }
+
+    return pressed;
+}
+
+/*******************************************************************************
+ * Function:    buttonTick
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: Changes buttonState, may post EVENT_BUTTON to the input task
+ *
+ * Overview: Runs the debounce state machine of each button on the last
+ *           shift register read. A steady button that changes starts
+ *           settling. Once a button has held the same level for DEBOUNCE_TIME
+ *           it is steady again. If that is the other level from where it
+ *           started, a press or release event is put in QUEUE_BUTTONS,
+ *           otherwise it was only a glitch.
+ *
+ * Note: Called from the Timer1 interrupt every system tick.
+ * ****************************************************************************/
+void buttonTick (void)
+{
+    int button;
+    int level;
+
+    for (button = 0; button < INPUT_COUNT; button++)
+    {
+        level = (callButtons >> button) & 1;
+
+        //A steady button that has changed starts settling
+        if (buttonState[button] == BUTTON_RELEASED ||
+            buttonState[button] == BUTTON_PRESSED)
+        {
+            if (level != (buttonState[button] == BUTTON_PRESSED))
+            {
+                buttonState[button] =
+                    level ? BUTTON_PRESSING : BUTTON_RELEASING;
+                buttonSample[button] = level;
+                buttonSettle[button] = DEBOUNCE_TIME;
+            }
+            continue;
+        }
+
+        //Still bouncing, start timing again
+        if (level != buttonSample[button])
+        {
+            buttonSample[button] = level;
+            buttonSettle[button] = DEBOUNCE_TIME;
+            continue;
+        }
+
+        buttonSettle[button]--;
+        if (buttonSettle[button] > 0)
+        {
+            continue;
+        }
+
+        if (level && buttonState[button] == BUTTON_PRESSING)
+        {
+            queuePut(QUEUE_BUTTONS, button);
+            signalEvent(QUEUE_TICK, TASK_INPUT, EVENT_BUTTON);
+        }
+        else if (!level && buttonState[button] == BUTTON_RELEASING)
+        {
+            queuePut(QUEUE_BUTTONS, button | BUTTON_EVENT_RELEASE);
+            signalEvent(QUEUE_TICK, TASK_INPUT, EVENT_BUTTON);
+        }
+
+        buttonState[button] = level ? BUTTON_PRESSED : BUTTON_RELEASED;
+    }
+}
+
+/*******************************************************************************
+ * Function:    initializeDisplay
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: Fills glyphLatA and glyphLatB
+ *
+ * Overview: Converts each glyph into the bits that need to be written to LATA
+ *           and LATB, so that a refresh only has to look them up.
+ *
+ * Note: The segments require a negative signal to turn on, so a lit segment
+ *       is a 0 in the port bits.
+ * ****************************************************************************/
+void initializeDisplay (void)
+{
+    unsigned char segments;
+    int glyph;
+
+    for (glyph = 0; glyph < GLYPH_COUNT; glyph++)
+    {
+        segments = glyphSegments[glyph];
+
+        glyphLatA[glyph] = SEG_LATA_MASK;
+        glyphLatB[glyph] = SEG_LATB_MASK;
+
+        if (segments & SEG_A)
+        {
+            glyphLatB[glyph] &= ~SEG_A_LATB;
+        }
+        if (segments & SEG_B)
+        {
+            glyphLatB[glyph] &= ~SEG_B_LATB;
+        }
+        if (segments & SEG_C)
+        {
+            glyphLatB[glyph] &= ~SEG_C_LATB;
+        }
+        if (segments & SEG_D)
+        {
+            glyphLatB[glyph] &= ~SEG_D_LATB;
+        }
+        if (segments & SEG_E)
+        {
+            glyphLatA[glyph] &= ~SEG_E_LATA;
+        }
+        if (segments & SEG_F)
+        {
+            glyphLatB[glyph] &= ~SEG_F_LATB;
+        }
+        if (segments & SEG_G)
+        {
+            glyphLatB[glyph] &= ~SEG_G_LATB;
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function:    displaySetGlyph
+ *
+ * PreCondition: none
+ * Input:   The digit, and the glyph to show on it, a number, a hexadecimal
+ *          letter or a GLYPH_ value
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Puts a glyph in the framebuffer. The digit shows it the next time
+ *           displayScan comes round to it.
+ *
+ * Note:
+ * ****************************************************************************/
+void displaySetGlyph (int digit, int glyph)
+{
+    displayGlyphs[digit] = glyph;
+}
+
+/*******************************************************************************
+ * Function:    displaySetNumber
+ *
+ * PreCondition: none
+ * Input:   The number to show
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Writes a number in decimal across the first DISPLAY_NUMBER_DIGITS
+ *           digits, without leading zeros.
+ *
+ * Note: Only the lowest digits are shown if the number does not fit.
+ * ****************************************************************************/
+void displaySetNumber (int number)
+{
+    int digit;
+
+    for (digit = DISPLAY_NUMBER_DIGITS - 1; digit >= 0; digit--)
+    {
+        if (number == 0 && digit != DISPLAY_NUMBER_DIGITS - 1)
+        {
+            displaySetGlyph(digit, GLYPH_BLANK);
+        }
+        else
+        {
+            displaySetGlyph(digit, number % 10);
+        }
+
+        number /= 10;
+    }
+}
+
+/*******************************************************************************
+ * Function:    displaySetLeds
+ *
+ * PreCondition: none
+ * Input:   The indicator LEDs to light, as their LATB bits
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Puts the indicator LEDs in the framebuffer. They change at the
+ *           next displayScan.
+ *
+ * Note:
+ * ****************************************************************************/
+void displaySetLeds (unsigned int leds)
+{
+    displayLeds = leds;
+}
+
+/*******************************************************************************
+ * Function:    displayScan
+ *
+ * PreCondition: initializeDisplay must have been called
+ * Input:   none
+ * Output:  none
+ * Side Effects: Changes scanDigit and callButtons
+ *
+ * Overview: Turns the display off, reads the call buttons while the segment
+ *           lines are free, then selects the next digit and puts its glyph
+ *           on the segment lines, along with the indicator LEDs. Each port
+ *           gets one masked write. Called every system tick, so each digit is
+ *           refreshed every DISPLAY_DIGITS milliseconds. Digits and LEDs
+ *           hidden by an animation are left dark.
+ *
+ * Note: The step interrupt writes the motor coils on the same ports, so it is
+ *       held off while the ports are updated.
+ * ****************************************************************************/
+void displayScan (void)
+{
+    int savedIpl = SRbits.IPL;
+    unsigned int latA;
+    unsigned int latB;
+    int glyph;
+
+    SRbits.IPL = 7;
+    LATA &= ~DIGIT_LATA_MASK;
+    LATB &= ~DIGIT_LATB_MASK;
+    SRbits.IPL = savedIpl;
+
+    callButtons = readCallButtons();
+
+    scanDigit++;
+    if (scanDigit >= DISPLAY_DIGITS)
+    {
+        scanDigit = 0;
+    }
+
+    glyph = (hiddenDigits & DIGIT_MASK(scanDigit)) ?
+            GLYPH_BLANK : displayGlyphs[scanDigit];
+    latA = glyphLatA[glyph] | digitLatA[scanDigit];
+    latB = glyphLatB[glyph] | digitLatB[scanDigit] |
+           (displayLeds & ~hiddenLeds);
+
+    SRbits.IPL = 7;
+    LATA = (LATA & ~(SEG_LATA_MASK | DIGIT_LATA_MASK)) | latA;
+    LATB = (LATB & ~(SEG_LATB_MASK | LED_LATB_MASK | DIGIT_LATB_MASK)) | latB;
+    SRbits.IPL = savedIpl;
+}
+
+/*******************************************************************************
+ * Function:    animationStart
+ *
+ * PreCondition: none
+ * Input:   The animation, the digits (as DIGIT_MASK bits) and indicator LEDs
+ *          (as their LATB bits) it blinks, its pattern, the number of bits in
+ *          the pattern, the time each bit is shown for in ms and the number of
+ *          times to show the pattern, or ANIMATION_FOREVER
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Starts blinking the targets with the pattern, one bit per step
+ *           from bit 0 up. The targets show their framebuffer contents for a
+ *           1 bit and are blanked for a 0 bit. Any animation already running
+ *           in the slot is replaced.
+ *
+ * Note: The animation is stepped by the Timer1 interrupt, so nothing waits
+ *       for it. Once it is over the targets are left showing.
+ * ****************************************************************************/
+void animationStart (int animation, unsigned int digits, unsigned int leds,
+                     unsigned int pattern, int steps, unsigned int stepMs,
+                     int repeats)
+{
+    _T1IE = 0;
+
+    animationDigits[animation] = digits;
+    animationLeds[animation] = leds;
+    animationPattern[animation] = pattern;
+    animationSteps[animation] = steps;
+    animationStepMs[animation] = stepMs;
+    animationRepeats[animation] = repeats;
+    animationStep[animation] = 0;
+    animationTime[animation] = stepMs;
+    animationActive[animation] = 1;
+
+    _T1IE = 1;
+}
+
+/*******************************************************************************
+ * Function:    animationStop
+ *
+ * PreCondition: none
+ * Input:   The animation to stop
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Stops an animation, leaving its targets showing from the next
+ *           system tick.
+ *
+ * Note:
+ * ****************************************************************************/
+void animationStop (int animation)
+{
+    animationActive[animation] = 0;
+}
+
+/*******************************************************************************
+ * Function:    animationRunning
+ *
+ * PreCondition: none
+ * Input:   The animation
+ * Output:  1 if the animation is still running, otherwise 0
+ * Side Effects: none
+ *
+ * Overview: Tells whether an animation has finished.
+ *
+ * Note:
+ * ****************************************************************************/
+int animationRunning (int animation)
+{
+    return animationActive[animation];
+}
+
+/*******************************************************************************
+ * Function:    animationTick
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: Changes hiddenDigits and hiddenLeds
+ *
+ * Overview: Moves each running animation on by a millisecond, stepping to the
+ *           next bit of its pattern when the current one has been shown for
+ *           long enough. The targets of every animation on a 0 bit are
+ *           collected into hiddenDigits and hiddenLeds for displayScan.
+ *
+ * Note: Called from the Timer1 interrupt every system tick.
+ * ****************************************************************************/
+void animationTick (void)
+{
+    unsigned int digits = 0;
+    unsigned int leds = 0;
+    int animation;
+
+    for (animation = 0; animation < ANIMATION_COUNT; animation++)
+    {
+        if (!animationActive[animation])
+        {
+            continue;
+        }
+
+        animationTime[animation]--;
+        if (animationTime[animation] == 0)
+        {
+            animationTime[animation] = animationStepMs[animation];
+            animationStep[animation]++;
+
+            if (animationStep[animation] == animationSteps[animation])
+            {
+                animationStep[animation] = 0;
+
+                if (animationRepeats[animation] != ANIMATION_FOREVER)
+                {
+                    animationRepeats[animation]--;
+                    if (animationRepeats[animation] == 0)
+                    {
+                        animationActive[animation] = 0;
+                        continue;
+                    }
+                }
+            }
+        }
+
+        if (!(animationPattern[animation] & (1u << animationStep[animation])))
+        {
+            digits |= animationDigits[animation];
+            leds |= animationLeds[animation];
+        }
+    }
+
+    hiddenDigits = digits;
+    hiddenLeds = leds;
+}
+
+/*******************************************************************************
+ * Function:    updateIndicators
+ *
+ * PreCondition: Floor must be reached
+ * Input:   none
+ * Output:  none
+ * Side Effects: none
+
+ * Overview: Displays the appropriate floor level on the segment display and 
+             turns on the appropriate indicator LED. The direction digit shows
+ *           which way the car is travelling.
+ *
+ * Note: Replaces any arrival estimate being shown, so TIMER_ETA is stopped
+ *       along with it.
+ * ****************************************************************************/
+void updateIndicators(void)
+{
+    timerStop(TIMER_ETA);
+    displaySetNumber(currentFloorLevel);
+    displaySetGlyph(DIGIT_DIRECTION, (tripDirection > 0) ? GLYPH_UP :
+                    (tripDirection < 0) ? GLYPH_DOWN : GLYPH_BLANK);
+    displaySetLeds(floorLeds[currentFloorLevel]);
+}
+
+/*******************************************************************************
+ * Function:    elevatorGoTo
+ *
+ * PreCondition: initializeStepTimer must have been called
+ * Input:   The floor to send the car to, starting from 1
+ * Output:  none
+ * Side Effects: Starts the Timer4 step interrupt
+ *
+ * Overview: Converts a floor into its absolute motor position and moves the
+ *           car there directly, however many floors away it is.
+ *
+ * Note: Returns immediately, motorMoving is cleared when the move is done.
+ * ****************************************************************************/
+void elevatorGoTo (int floor)
+{
+    motionMoveTo(floorPosition(floor));
+}
+
+/*******************************************************************************
+ * Function:    floorPosition
+ *
+ * PreCondition: none
+ * Input:   The floor, starting from 1
+ * Output:  The motor position of that floor, in half steps
+ * Side Effects: none
+ *
+ * Overview: Looks the floor up in floorPositions, built from BUILDING.
+ *
+ * Note:
+ * ****************************************************************************/
+int floorPosition (int floor)
+{
+    return floorPositions[floor];
+}
+
+/*******************************************************************************
+ * Function:    motionCanStopAt
+ *
+ * PreCondition: none
+ * Input:   The floor to check
+ * Output:  1 if the car can stop at the floor without turning back, else 0
+ * Side Effects: none
+ *
+ * Overview: A moving car can only stop at a floor that is still ahead of the
+ *           point where it would come to rest if it started slowing down now.
+ *
+ * Note: Every floor is fine when at rest.
+ * ****************************************************************************/
+int motionCanStopAt (int floor)
+{
+    int position = floorPosition(floor);
+    int stoppingPosition = motionStoppingPosition();
+
+    if ((motorDirection > 0 && position < stoppingPosition) ||
+        (motorDirection < 0 && position > stoppingPosition))
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*******************************************************************************
+ * Function:    registerCall
+ *
+ * PreCondition: none
+ * Input:   The floor, and CALL_CAR, CALL_UP or CALL_DOWN
+ * Output:  The floor that was called, or 0 if the car stopped there takes
+ *          the press instead
+ * Side Effects: Sets a bit of floorCalls
+ *
+ * Overview: Adds a call to floorCalls. Calling a floor that already has the
+ *           same call waiting does no harm.
+ *
+ * Note: A car stopped at the floor takes a car call, or a hall call the way
+ *       it will leave, as a door request instead. A hall call the other way
+ *       is registered, so that the car comes back for it. A parking car
+ *       registers every press, and serves the ones at its parking floor
+ *       when it arrives.
+ * ****************************************************************************/
+int registerCall (int floor, unsigned char call)
+{
+    int next;
+
+    if (!motorMoving && (tripState == TRIP_IDLE || tripState == TRIP_DOORS) &&
+        floorPosition(floor) == motorPosition)
+    {
+        next = lookNextStop(floorCalls, floor, sweepDirection);
+
+        if (call == CALL_CAR || next == 0 || call == CALL_HALL(next - floor))
+        {
+            return 0;
+        }
+    }
+
+    floorCalls[floor] |= call;
+
+    return floor;
+}
+
+/*******************************************************************************
+ * Function:    serveCalls
+ *
+ * PreCondition: none
+ * Input:   The call table, the floor the car has stopped at and the direction
+ *          it was sweeping in
+ * Output:  The call bits that were served
+ * Side Effects: Clears bits of the call table
+ *
+ * Overview: Serves the car call and the hall call going on in the same
+ *           direction, or every call at the floor if the car turns round
+ *           there.
+ *
+ * Note: Used both for the real calls and for the copy planRoute works on.
+ * ****************************************************************************/
+unsigned char serveCalls (unsigned char *calls, int floor, int direction)
+{
+    unsigned char served = calls[floor] & (CALL_CAR | CALL_HALL(direction));
+
+    calls[floor] &= ~served;
+
+    if (stopAhead(calls, floorPosition(floor), direction, 0) == 0)
+    {
+        served |= calls[floor];
+        calls[floor] = 0;
+    }
+
+    return served;
+}
+
+/*******************************************************************************
+ * Function:    stopAhead
+ *
+ * PreCondition: none
+ * Input:   The call table, the position to look from, 1 to look above it or
+ *          -1 to look below it, and whether this is the moving car
+ * Output:  The next floor to stop at in that direction, or 0 if there is none
+ * Side Effects: none
+ *
+ * Overview: Finds the closest floor ahead in the given direction with a car
+ *           call, or a hall call going the same way. Hall calls going the
+ *           other way are skipped for now, unless nothing else is ahead, in
+ *           which case the farthest of them is taken so the car turns round
+ *           there. Floors the moving car can no longer stop at are passed
+ *           over.
+ *
+ * Note:
+ * ****************************************************************************/
+int stopAhead (const unsigned char *calls, int position, int direction,
+               int moving)
+{
+    unsigned char stopCalls = CALL_CAR | CALL_HALL(direction);
+    int nearest = 0;
+    int nearestDistance = 0;
+    int farthest = 0;
+    int farthestDistance = 0;
+    int distance;
+    int floor;
+
+    for (floor = GROUND_FLOOR; floor <= TOP_FLOOR; floor++)
+    {
+        distance = (floorPosition(floor) - position) * direction;
+
+        if (calls[floor] == 0 || distance <= 0 ||
+            (moving && !motionCanStopAt(floor)))
+        {
+            continue;
+        }
+
+        if ((calls[floor] & stopCalls) &&
+            (nearest == 0 || distance < nearestDistance))
+        {
+            nearest = floor;
+            nearestDistance = distance;
+        }
+
+        if (distance > farthestDistance)
+        {
+            farthest = floor;
+            farthestDistance = distance;
+        }
+    }
+
+    return (nearest != 0) ? nearest : farthest;
+}
+
+/*******************************************************************************
+ * Function:    lookNextStop
+ *
+ * PreCondition: none
+ * Input:   The call table, the floor the car is stopped at and its sweep
+ *          direction
+ * Output:  The floor to go to next, or 0 if there are no calls
+ * Side Effects: none
+ *
+ * Overview: Picks the next stop with the LOOK algorithm. Every call in the
+ *           sweep direction is served before the car turns round for the
+ *           calls behind it, and hall calls are only stopped for on the way
+ *           the caller wants to go. With no sweep under way the call that
+ *           can be reached soonest is taken, going up on a tie.
+ *
+ * Note:
+ * ****************************************************************************/
+int lookNextStop (const unsigned char *calls, int floor, int direction)
+{
+    int position = floorPosition(floor);
+    int ahead;
+    int up;
+    int down;
+
+    if (direction != 0)
+    {
+        ahead = stopAhead(calls, position, direction, 0);
+        return (ahead != 0) ? ahead : stopAhead(calls, position, -direction, 0);
+    }
+
+    up = stopAhead(calls, position, 1, 0);
+    down = stopAhead(calls, position, -1, 0);
+
+    if (up == 0 ||
+        (down != 0 && travelTime[floor][down] < travelTime[floor][up]))
+    {
+        return down;
+    }
+
+    return up;
+}
+
+/*******************************************************************************
+ * Function:    planRoute
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: Fills routeEta
+ *
+ * Overview: Follows the car through a copy of the call table, stop by stop,
+ *           the same way the motion task will, adding up the travel time of
+ *           each leg and doorCycleTime at each stop. Every call gets the
+ *           time from the start of the current leg or the end of the current
+ *           door cycle until it is served.
+ *
+ * Note: Only needed when the calls or the trip change. The progress of the
+ *       car within the current leg or door cycle is added by callEta.
+ * ****************************************************************************/
+void planRoute (void)
+{
+    unsigned char calls[FLOOR_COUNT + 1];
+    unsigned char served;
+    unsigned int time = 0;
+    int direction = sweepDirection;
+    int floor = currentFloorLevel;
+    int next;
+    int type;
+
+    for (next = GROUND_FLOOR; next <= TOP_FLOOR; next++)
+    {
+        calls[next] = floorCalls[next];
+
+        for (type = 0; type < CALL_TYPES; type++)
+        {
+            routeEta[next][type] = ETA_NONE;
+        }
+    }
+
+    //The moving car serves its current stop at the end of the leg
+    if (tripState == TRIP_MOVING)
+    {
+        served = serveCalls(calls, floor, direction);
+
+        for (type = 0; type < CALL_TYPES; type++)
+        {
+            if (served & (1 << type))
+            {
+                routeEta[floor][type] = 0;
+            }
+        }
+
+        time = doorCycleTime;
+    }
+
+    while ((next = lookNextStop(calls, floor, direction)) != 0)
+    {
+        direction = (next > floor) ? 1 : -1;
+        time += travelTime[floor][next];
+        served = serveCalls(calls, next, direction);
+
+        for (type = 0; type < CALL_TYPES; type++)
+        {
+            if (served & (1 << type))
+            {
+                routeEta[next][type] = time;
+            }
+        }
+
+        time += doorCycleTime;
+        floor = next;
+    }
+}
+
+/*******************************************************************************
+ * Function:    callEta
+ *
+ * PreCondition: planRoute must have been called since the calls last changed
+ * Input:   The floor, and the call type, 0 for the car call, 1 for the up and
+ *          2 for the down hall call
+ * Output:  Estimated ms until the car serves the call, or ETA_NONE
+ * Side Effects: none
+ *
+ * Overview: Adds what is left of the current leg or door cycle to the
+ *           planned time of the call. The time left of a leg is its
+ *           estimate less the tripTicks the step interrupt has counted so
+ *           far, so the estimate follows the car as it moves without any
+ *           replanning.
+ *
+ * Note: Shown by the display task for each new hall call.
+ * ****************************************************************************/
+unsigned int callEta (int floor, int type)
+{
+    unsigned long elapsed;
+    unsigned long now;
+    unsigned int left = 0;
+
+    if (routeEta[floor][type] == ETA_NONE)
+    {
+        return ETA_NONE;
+    }
+
+    if (tripState == TRIP_MOVING || tripState == TRIP_PARKING)
+    {
+        _T4IE = 0;
+        elapsed = tripTicks / STEP_TIMER_TICKS_PER_MS;
+        _T4IE = 1;
+
+        if (elapsed < legTime)
+        {
+            left = legTime - elapsed;
+        }
+    }
+    else if (tripState == TRIP_DOORS)
+    {
+        _T1IE = 0;
+        now = systemTime;
+        _T1IE = 1;
+
+        if (now < departTime)
+        {
+            left = departTime - now;
+        }
+    }
+
+    return left + routeEta[floor][type];
+}
+
+/*******************************************************************************
+ * Function:    initializeStepTimer
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Configures Timer4 to generate one interrupt per motor step. The
+ *           timer is left off until a move is started.
+ *
+ * Note: The step interrupt runs at a higher priority than INT1 and the
+ *       system tick so that step timing is not disturbed.
+ * ****************************************************************************/
+void initializeStepTimer (void)
+{
+    T4CON = 0;
+    T4CONbits.TCKPS = 1; //1:8 prescaler, 500 timer ticks per millisecond
+
+    TMR4 = 0;
+    PR4 = MOTOR_DELAY * STEP_TIMER_TICKS_PER_MS;
+
+    initializeRampTable();
+    buildCoilMasks();
+
+    _T4IP = 6;
+    _T4IF = 0;
+    _T4IE = 1;
+}
+
+/*******************************************************************************
+ * Function:    motionMoveTo
+ *
+ * PreCondition: initializeStepTimer must have been called
+ * Input:   The absolute step count to move the motor to
+ * Output:  none
+ * Side Effects: Starts the Timer4 step interrupt
+ *
+ * Overview: Sets a new target for the step interrupt and starts the timer if
+ *           the motor is not already moving. The first step is taken straight
+ *           away by setting the Timer4 interrupt flag.
+ *
+ * Note: Can be called while a move is in progress, the interrupt replans the
+ *       rest of the trip towards the new target without stopping. A target
+ *       that is too close to stop at is overshot and approached again, so
+ *       callers should check motionStoppingPosition first.
+ * ****************************************************************************/
+void motionMoveTo (int position)
+{
+    motorTarget = position;
+
+    if (!motorMoving && motorPosition != motorTarget)
+    {
+        _T4IE = 0; //Timer4 may still be running to hold the coils
+
+        motorMoving = 1;
+        rampLevel = 0;
+        motorDirection = 0;
+        tripTicks = 0;
+
+        TMR4 = 0;
+        T4CONbits.TON = 1;
+        _T4IF = 1; //Take the first step immediately
+
+        _T4IE = 1;
+    }
+}
+
+/*******************************************************************************
+ * Function:    motionRetarget
+ *
+ * PreCondition: none
+ * Input:   The new absolute step count for a move in progress
+ * Output:  1 if the target was changed, 0 if the car has already reached it
+ * Side Effects: Changes motorTarget
+ *
+ * Overview: Moves the target of a move that is still under way. The step
+ *           interrupt keeps motorMoving set for one more period after the
+ *           last step, so motorMoving alone can not tell whether the car is
+ *           still travelling. The target is only changed while there are
+ *           steps left, with the step interrupt held off so that the last
+ *           step can not be taken in between.
+ *
+ * Note: A car that has reached its target is left to arrive there.
+ * ****************************************************************************/
+int motionRetarget (int position)
+{
+    int moved = 0;
+
+    _T4IE = 0;
+    if (motorMoving && motorPosition != motorTarget)
+    {
+        motorTarget = position;
+        moved = 1;
+    }
+    _T4IE = 1;
+
+    return moved;
+}
+
+/*******************************************************************************
+ * Function:    motionStoppingPosition
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  The nearest motor position the car can stop at
+ * Side Effects: none
+ *
+ * Overview: Slowing down takes one whole step per speed level, so the car
+ *           can not stop any closer than rampLevel whole steps ahead in its
+ *           current direction, whatever the drive mode. At rest this is just
+ *           motorPosition.
+ *
+ * Note: The step interrupt is held off while the state is read so that the
+ *       position and speed level belong to the same step.
+ * ****************************************************************************/
+int motionStoppingPosition (void)
+{
+    int position;
+    int distance;
+
+    _T4IE = 0;
+    position = motorPosition;
+    distance = rampLevel * HALF_STEPS_PER_STEP;
+    if (motorDirection < 0)
+    {
+        distance = -distance;
+    }
+    _T4IE = 1;
+
+    return position + distance;
+}
+
+/*******************************************************************************
+ * Function:    motorOutput
+ *
+ * PreCondition: none
+ * Input:   The motor position to energise the coils for
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Energises the coils that belong to a motor position in the
+ *           current drive mode. The coils repeat every eight half steps, so
+ *           going up walks forwards through the row of phaseTable and going
+ *           down walks backwards.
+ *
+ * Note: Uses the port bits precomputed by buildCoilMasks, so each port gets a
+ *       single read-modify-write. The opposing coils of the motor share a
+ *       port, so no illegal coil state can appear between the two writes.
+ *       Callers outside the step interrupt must raise the IPL to 7 first, or
+ *       an interrupt writing the same port could lose its update.
+ * ****************************************************************************/
+void motorOutput (int position)
+{
+    int phase = position & 7;
+
+    LATA = (LATA & ~COIL_LATA_MASK) | coilLatA[phase];
+    LATB = (LATB & ~COIL_LATB_MASK) | coilLatB[phase];
+}
+
+/*******************************************************************************
+ * Function:    motionSetDriveMode
+ *
+ * PreCondition: The motor must not be moving
+ * Input:   DRIVE_WAVE, DRIVE_TWO_PHASE or DRIVE_HALF_STEP
+ * Output:  none
+ * Side Effects: Changes the coils that are energised and travelTime
+ *
+ * Overview: Selects the coil sequence used for the following trips. Coils
+ *           that are being held fully on are switched to the new mode
+ *           straight away. Chopped coils pick it up at their next on period,
+ *           and released coils are left off until the next trip.
+ *
+ * Note: Ignored while a trip is in progress. The full step modes need an even
+ *       motorPosition, which is always true at a floor. Every interrupt is
+ *       held off while the coil masks and hold state are used and the coils
+ *       written, as the hold chopper uses the masks and displayScan writes
+ *       the same ports.
+ * ****************************************************************************/
+void motionSetDriveMode (int mode)
+{
+    int savedIpl = SRbits.IPL;
+
+    if (motorMoving || (driveStepShift[mode] != 0 && (motorPosition & 1)))
+    {
+        return;
+    }
+
+    driveMode = mode;
+    buildTravelTable();
+
+    SRbits.IPL = 7;
+    buildCoilMasks();
+    if (holdCount > 0 || holdPolicy == HOLD_FULL)
+    {
+        motorOutput(motorPosition);
+    }
+    SRbits.IPL = savedIpl;
+}
+
+/*******************************************************************************
+ * Function:    buildCoilMasks
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: Fills coilLatA and coilLatB
+ *
+ * Overview: Converts each coil pattern of the current drive mode into the bits
+ *           that need to be set in LATA and LATB, so that the step interrupt
+ *           only has to look them up.
+ *
+ * Note: Must be called whenever driveMode changes.
+ * ****************************************************************************/
+void buildCoilMasks (void)
+{
+    unsigned char coils;
+    int phase;
+
+    for (phase = 0; phase < 8; phase++)
+    {
+        coils = phaseTable[driveMode][phase];
+
+        coilLatA[phase] = 0;
+        coilLatB[phase] = 0;
+
+        if (coils & COIL_BLACK)
+        {
+            coilLatB[phase] |= BLACK_LATB;
+        }
+        if (coils & COIL_YELLOW)
+        {
+            coilLatA[phase] |= YELLOW_LATA;
+        }
+        if (coils & COIL_BROWN)
+        {
+            coilLatB[phase] |= BROWN_LATB;
+        }
+        if (coils & COIL_ORANGE)
+        {
+            coilLatA[phase] |= ORANGE_LATA;
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function:    motorHold
+ *
+ * PreCondition: Called from the step interrupt once the car has arrived
+ * Input:   none
+ * Output:  none
+ * Side Effects: Changes the coils and the Timer4 period
+ *
+ * Overview: Keeps the last coils fully on for HOLD_FULL_TIME so the car settles,
+ *           then applies holdPolicy. HOLD_FULL leaves the coils on,
+ *           HOLD_RELEASE turns them off and HOLD_REDUCED keeps chopping them
+ *           on for HOLD_ON_TICKS and off for HOLD_OFF_TICKS, which lowers the
+ *           average holding current to a quarter.
+ *
+ * Note: The coils sit on RA0, RA1, RB0 and RB1. RA0 and RA1 are not remappable
+ *       pins, so an output compare module can not reach every coil and the
+ *       chopping is done by Timer4 instead. Timer4 is stopped once nothing
+ *       more needs to be timed.
+ * ****************************************************************************/
+void motorHold (void)
+{
+    if (holdCount > 0)
+    {
+        holdCount--;
+        return;
+    }
+
+    if (holdPolicy == HOLD_REDUCED)
+    {
+        holdCoilsOn = !holdCoilsOn;
+
+        if (holdCoilsOn)
+        {
+            motorOutput(motorPosition);
+            PR4 = HOLD_ON_TICKS;
+        }
+        else
+        {
+            motorRelease();
+            PR4 = HOLD_OFF_TICKS;
+        }
+        return;
+    }
+
+    if (holdPolicy == HOLD_RELEASE)
+    {
+        motorRelease();
+    }
+
+    T4CONbits.TON = 0;
+}
+
+/*******************************************************************************
+ * Function:    motorRelease
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Turns every motor coil off.
+ *
+ * Note: The next step energises the coils again from motorPosition.
+ * ****************************************************************************/
+void motorRelease (void)
+{
+    LATA &= ~COIL_LATA_MASK;
+    LATB &= ~COIL_LATB_MASK;
+}
+
+/*******************************************************************************
+ * Function:    initializeRampTable
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: Fills rampTable and travelTime
+ *
+ * Overview: Works out the Timer4 period for every speed level of the selected
+ *           motion profile.
+ *
+ *           PROFILE_CONSTANT fills every level with MOTOR_DELAY, the same as
+ *           the original fixed speed stepping.
+ *
+ *           PROFILE_TRAPEZOID uses a constant acceleration ramp. Speed squared
+ *           grows linearly with the number of steps taken, so level n has a
+ *           period of
+ *
+ *              S * C * sqrt(N) / sqrt(N*C^2 + (S^2 - C^2) * n)
+ *
+ *           where S is the starting period, C the cruise period and N the
+ *           last level.
+ *
+ *           PROFILE_SCURVE is worked out by sCurvePeriod.
+ *
+ * Note: Only run at start-up or when the profile is changed, so the 64 bit
+ *       division is not a concern. The step interrupt just reads the table.
+ * ****************************************************************************/
+void initializeRampTable (void)
+{
+    unsigned long start = MOTOR_DELAY * STEP_TIMER_TICKS_PER_MS;
+    unsigned long cruise = MOTOR_CRUISE_DELAY * STEP_TIMER_TICKS_PER_MS;
+    unsigned long lastLevelTerm = (RAMP_STEPS - 1) * cruise * cruise;
+    unsigned long long squaredPeriod;
+    int level;
+
+    for (level = 0; level < RAMP_STEPS; level++)
+    {
+        if (motionProfile == PROFILE_TRAPEZOID)
+        {
+            squaredPeriod = (unsigned long long) start * start * lastLevelTerm /
+                            (lastLevelTerm +
+                            (unsigned long long) (start*start - cruise*cruise) * level);
+
+            rampTable[level] = (unsigned int) squareRoot(squaredPeriod);
+        }
+        else if (motionProfile == PROFILE_SCURVE)
+        {
+            rampTable[level] = sCurvePeriod(level);
+        }
+        else
+        {
+            rampTable[level] = (unsigned int) start;
+        }
+    }
+
+    buildTravelTable();
+}
+
+/*******************************************************************************
+ * Function:    motionSetProfile
+ *
+ * PreCondition: The motor must not be moving
+ * Input:   PROFILE_CONSTANT, PROFILE_TRAPEZOID or PROFILE_SCURVE
+ * Output:  none
+ * Side Effects: Rebuilds rampTable
+ *
+ * Overview: Selects the motion profile used for the following trips.
+ *
+ * Note: Ignored while a trip is in progress so that the step interrupt never
+ *       reads a half built table.
+ * ****************************************************************************/
+void motionSetProfile (int profile)
+{
+    if (motorMoving)
+    {
+        return;
+    }
+
+    motionProfile = profile;
+    initializeRampTable();
+}
+
+/*******************************************************************************
+ * Function:    sCurvePeriod
+ *
+ * PreCondition: none
+ * Input:   The speed level, from 0 to RAMP_STEPS - 1
+ * Output:  The Timer4 period for that speed level
+ * Side Effects: none
+ *
+ * Overview: The speed follows the smoothstep curve 3x^2 - 2x^3 across the
+ *           ramp, so acceleration builds up from zero, peaks half way and
+ *           falls back to zero at cruise speed. This removes the jolt at
+ *           the start and end of each ramp. Speed is the inverse of the
+ *           period, so level n has a period of
+ *
+ *              S * C / (C + (S - C) * smoothstep(n / N))
+ *
+ * Note: Everything is done in Q15 fixed point with 32 bit intermediates, so
+ *       it is cheap enough to evaluate well within one step period.
+ * ****************************************************************************/
+unsigned int sCurvePeriod (int level)
+{
+    unsigned long start = MOTOR_DELAY * STEP_TIMER_TICKS_PER_MS;
+    unsigned long cruise = SCURVE_CRUISE_DELAY * STEP_TIMER_TICKS_PER_MS;
+    unsigned long x; //Position along the ramp, Q15
+    unsigned long smooth; //Fraction of the speed change applied, Q15
+
+    x = ((unsigned long) level << 15) / (RAMP_STEPS - 1);
+    smooth = (((x * x) >> 15) * (3ul*32768 - 2*x)) >> 15;
+
+    return (unsigned int) (start * cruise /
+                          (cruise + (((start - cruise) * smooth) >> 15)));
+}
+
+/*******************************************************************************
+ * Function:    moveTime
+ *
+ * PreCondition: rampTable must be built
+ * Input:   The distance to move, in half steps
+ * Output:  The time the move takes from rest to rest, in ms
+ * Side Effects: none
+ *
+ * Overview: Steps through the move the same way the step interrupt would,
+ *           with the current profile and drive mode, adding up the step
+ *           periods.
+ *
+ * Note: Too slow to run for every estimate, see buildTravelTable.
+ * ****************************************************************************/
+unsigned int moveTime (int distance)
+{
+    unsigned long ticks = 0;
+    int shift = driveStepShift[driveMode];
+    int level = 0;
+    int levelsAhead;
+    int stepSize;
+
+    while (distance > 0)
+    {
+        stepSize = 1 << shift;
+        if (stepSize > distance)
+        {
+            stepSize = distance;
+        }
+        distance -= stepSize;
+
+        /* Moves start and end on whole steps, like the floors, so the
+         * distance left is whole whenever the car is on a whole step */
+        levelsAhead = distance / HALF_STEPS_PER_STEP;
+        if ((distance & (HALF_STEPS_PER_STEP - 1)) == 0)
+        {
+            if (level < levelsAhead && level < RAMP_STEPS - 1)
+            {
+                level++;
+            }
+            else if (level > levelsAhead)
+            {
+                level--;
+            }
+        }
+
+        ticks += (rampTable[level] >> (1 - shift)) + 1; //As tripTicks counts
+    }
+
+    return (unsigned int) (ticks / STEP_TIMER_TICKS_PER_MS);
+}
+
+/*******************************************************************************
+ * Function:    buildTravelTable
+ *
+ * PreCondition: rampTable must be built
+ * Input:   none
+ * Output:  none
+ * Side Effects: Fills travelTime
+ *
+ * Overview: Works out the travel time between every pair of floors, so that
+ *           the arrival estimates only have to look them up.
+ *
+ * Note: Must be called again whenever the profile or drive mode changes.
+ * ****************************************************************************/
+void buildTravelTable (void)
+{
+    int from;
+    int to;
+    int distance;
+
+    for (from = GROUND_FLOOR; from <= TOP_FLOOR; from++)
+    {
+        for (to = GROUND_FLOOR; to <= TOP_FLOOR; to++)
+        {
+            distance = floorPosition(to) - floorPosition(from);
+            travelTime[from][to] =
+                moveTime((distance < 0) ? -distance : distance);
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function:    demandAdvance
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: Clears buckets of demandCount
+ *
+ * Overview: Brings demandPeriod up to date with systemTime, clearing the
+ *           bucket of each period that has started since, so that calls
+ *           older than DEMAND_BUCKETS periods are forgotten.
+ *
+ * Note: Nothing has to run at the bucket boundaries, the buckets are caught
+ *       up whenever they are next used.
+ * ****************************************************************************/
+void demandAdvance (void)
+{
+    unsigned long period;
+    int passed;
+    int floor;
+
+    _T1IE = 0;
+    period = systemTime / DEMAND_BUCKET_TIME;
+    _T1IE = 1;
+
+    for (passed = 0; demandPeriod != period && passed < DEMAND_BUCKETS;
+         passed++)
+    {
+        demandPeriod++;
+
+        for (floor = GROUND_FLOOR; floor <= TOP_FLOOR; floor++)
+        {
+            demandCount[demandPeriod % DEMAND_BUCKETS][floor] = 0;
+        }
+    }
+
+    demandPeriod = period;
+}
+
+/*******************************************************************************
+ * Function:    demandRecord
+ *
+ * PreCondition: none
+ * Input:   The floor a hall call was made at
+ * Output:  none
+ * Side Effects: Changes demandCount
+ *
+ * Overview: Counts the call in the bucket for the current period.
+ *
+ * Note: The count stops at DEMAND_MAX rather than wrapping round.
+ * ****************************************************************************/
+void demandRecord (int floor)
+{
+    unsigned char *count;
+
+    demandAdvance();
+
+    count = &demandCount[demandPeriod % DEMAND_BUCKETS][floor];
+
+    if (*count < DEMAND_MAX)
+    {
+        (*count)++;
+    }
+}
+
+/*******************************************************************************
+ * Function:    parkFloor
+ *
+ * PreCondition: buildTravelTable must have been called
+ * Input:   none
+ * Output:  The floor to park the idle car at
+ * Side Effects: May clear buckets of demandCount
+ *
+ * Overview: Predicts the demand at each floor from the call history, with
+ *           each bucket weighted by how recent it is, the current bucket
+ *           DEMAND_BUCKETS times and the oldest once. The car is parked at
+ *           the floor with the least travel time to the next call, averaged
+ *           over that demand. With the calls all at one floor this is that
+ *           floor, with the calls spread out it is somewhere in between.
+ *
+ * Note: The car stays where it is unless another floor is strictly better,
+ *       so with no call history it is never moved.
+ * ****************************************************************************/
+int parkFloor (void)
+{
+    unsigned long demand[FLOOR_COUNT + 1];
+    unsigned long cost;
+    unsigned long bestCost = 0;
+    int best = GROUND_FLOOR;
+    int age;
+    int floor;
+    int park;
+
+    demandAdvance();
+
+    for (floor = GROUND_FLOOR; floor <= TOP_FLOOR; floor++)
+    {
+        demand[floor] = 0;
+
+        for (age = 0; age < DEMAND_BUCKETS; age++)
+        {
+            demand[floor] += (unsigned long) (DEMAND_BUCKETS - age) *
+                demandCount[(demandPeriod - age) % DEMAND_BUCKETS][floor];
+        }
+    }
+
+    for (park = GROUND_FLOOR; park <= TOP_FLOOR; park++)
+    {
+        cost = 0;
+
+        for (floor = GROUND_FLOOR; floor <= TOP_FLOOR; floor++)
+        {
+            cost += demand[floor] * travelTime[park][floor];
+        }
+
+        if (park == GROUND_FLOOR || cost < bestCost ||
+            (cost == bestCost && park == currentFloorLevel))
+        {
+            best = park;
+            bestCost = cost;
+        }
+    }
+
+    return best;
+}
+
+/*******************************************************************************
+ * Function:    squareRoot
+ *
+ * PreCondition: none
+ * Input:   The value to take the square root of
+ * Output:  The integer square root, rounded down
+ * Side Effects: none
+ *
+ * Overview: Bit by bit integer square root, so that the float library is not
+ *           needed to build the ramp table.
+ *
+ * Note:
+ * ****************************************************************************/
+unsigned long squareRoot (unsigned long value)
+{
+    unsigned long root = 0;
+    unsigned long bit = 1ul << 30;
+
+    while (bit > value)
+    {
+        bit >>= 2;
+    }
+
+    while (bit != 0)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return root;
+}
+
+/*******************************************************************************
+ * Function:    _T4Interrupt
+ *
+ * PreCondition: A move must have been started with motionMoveTo
+ * Input:   none
+ * Output:  none
+ * Side Effects: Updates motorPosition and the motor coils
+ *
+ * Overview: Takes one step towards motorTarget each time Timer4 expires. Once
+ *           the target has been reached the timer is stopped and motorMoving
+ *           is cleared.
+ *
+ *           The next period comes from rampTable. The speed level goes up by
+ *           one each whole step while the car could still stop in the whole
+ *           steps left, holds at cruise speed, and comes down by one each
+ *           whole step so that the car slows back to the starting speed for
+ *           the final step. In half step mode the level only changes every
+ *           second half step, so the car speeds up and slows down at the same
+ *           rate as in the full step modes.
+ *
+ *           The target may be changed at any time. A further target simply
+ *           extends the cruise. A target that is too close, or behind the car,
+ *           is handled by slowing down at the normal rate, and once at the
+ *           starting speed the car turns around and heads back to it.
+ *
+ * Note: The final interrupt after the last step gives the car one step period
+ *       to settle before motorMoving is cleared. Timer4 then keeps running
+ *       for motorHold until the hold policy has been applied.
+ * ****************************************************************************/
+void __attribute__((interrupt,no_auto_psv)) _T4Interrupt (void)
+{
+    int stepsAhead; //Half steps to the target in the direction of travel
+    int levelsAhead; //Steps that can still be taken before stopping
+    int stepSize = 1 << driveStepShift[driveMode];
+
+    _T4IF = 0;
+
+    if (!motorMoving)
+    {
+        motorHold();
+        return;
+    }
+
+    stepsAhead = motorTarget - motorPosition;
+    if (motorDirection == 0)
+    {
+        motorDirection = (stepsAhead < 0) ? -1 : 1;
+    }
+    if (motorDirection < 0)
+    {
+        stepsAhead = -stepsAhead;
+    }
+
+    //Only stop or turn around once the car is back to the starting speed
+    if (stepsAhead <= 0 && rampLevel == 0)
+    {
+        if (stepsAhead == 0)
+        {
+            //Arrived, keep the timer running to time the coil hold
+            motorMoving = 0;
+            motorDirection = 0;
+            signalEvent(QUEUE_STEP, TASK_MOTION, EVENT_ARRIVED);
+
+            holdCount = HOLD_FULL_TIME / HOLD_TICK;
+            holdCoilsOn = 1;
+            PR4 = HOLD_TICK * STEP_TIMER_TICKS_PER_MS;
+            return;
+        }
+
+        motorDirection = -motorDirection;
+        stepsAhead = -stepsAhead;
+    }
+
+    //Never step past the target
+    if (stepsAhead > 0 && stepSize > stepsAhead)
+    {
+        stepSize = stepsAhead;
+    }
+
+    if (motorDirection > 0)
+    {
+        motorPosition += stepSize;
+    }
+    else
+    {
+        motorPosition -= stepSize;
+    }
+    motorOutput(motorPosition);
+
+    /* Count what is left in whole steps, so that half stepping keeps the
+     * same acceleration and only the speed level changes on whole steps */
+    stepsAhead -= stepSize;
+    levelsAhead = (stepsAhead > 0) ? stepsAhead / HALF_STEPS_PER_STEP : 0;
+
+    if ((motorPosition & (HALF_STEPS_PER_STEP - 1)) == 0)
+    {
+        //Accelerate by one level per step while the car could still stop
+        if (rampLevel < levelsAhead && rampLevel < RAMP_STEPS - 1)
+        {
+            rampLevel++;
+        }
+        //Otherwise slow down by one level per step
+        else if (rampLevel > levelsAhead)
+        {
+            rampLevel--;
+        }
+    }
+
+    /* rampTable holds full step periods, a half step only needs half of the
+     * time to keep the same speed */
+    PR4 = rampTable[rampLevel] >> (1 - driveStepShift[driveMode]);
+    tripTicks += PR4 + 1; //Timer4 counts from 0 to PR4 each period
+}
+
+/*******************************************************************************
+ * Function:   initializeInterrupt
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Configures RB2 on the PIC to be used as an interrupt
+ *
+ * Note:
+ * ****************************************************************************/
+void initializeInterrupt1 (void)//Initializing Interrupt 1
+{
+    /* Initialize Input Interrupt Switch (AN4/RP2/RB2) for use as a fire alarm
+     * switch */
+
+_INT1R = 2; //Assign INT1 input function to RP2 (RB2)
+	
+_INT1EP = 1; /* Interrupt INT1 on negative edge (when button is pressed,
+              * it returns a '0') */
+	
+_INT1IF = 0; //Clear INT1 flag
+	
+_INT1IE = 1; //Enable INT1 interrupt
+
+}//end initializeInterrupt1
+
+/*******************************************************************************
+ * Function:    interrupt
+ *
+ * PreCondition: Interrupt button (Fire alarm) must be pressed
+ * Input:   none
+ * Output:  none
+ * Side Effects:
+ *
+ * Overview: Hands the fire alarm to the tasks. The motion task sends the
+ *           elevator down to the ground floor and resets the PIC once the
+ *           alarm is over, the display task flashes the Fire alarm LED and
+ *           the letter 'F' three times, and the audio task sounds the siren.
+ *
+ * Note: Only posts events, as the software timers and the buzzer belong to
+ *       the main loop and may be part way through an update when INT1 comes.
+ * ****************************************************************************/
+void __attribute__((interrupt,no_auto_psv)) _INT1Interrupt (void) //ISR
+{
+    //Clear INT1 flag after an interrupt has been initiated
+    //which resets the entire process
+    _INT1IF = 0;
+
+    signalEvent(QUEUE_FIRE, TASK_MOTION, EVENT_FIRE);
+    signalEvent(QUEUE_FIRE, TASK_DISPLAY, EVENT_ALARM);
+    signalEvent(QUEUE_FIRE, TASK_AUDIO, EVENT_SIREN); //Buzzer is sounded
+}//end _INT1Interrupt
+
+/*******************************************************************************
+ * Function:    initializeBuzzer
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Routes OC1 to the buzzer pin (RB10) and sets up Timer2 as its
+ *           time base. The buzzer stays quiet until buzzerOn is called.
+ *
+ * Note: Timer2 counts at Fcy, so a tone period is given in the same ticks as
+ *       delay and can be set with US_TO_TICKS.
+ * ****************************************************************************/
+void initializeBuzzer (void)
+{
+    BUZZER_PPS = OC1_OUTPUT;
+
+    T2CON = 0; //1:1 prescaler, 4000 timer ticks per millisecond
+    TMR2 = 0;
+
+    OC1CON = 0; //Output compare off, using Timer2
+    OC1R = 0;
+    OC1RS = 0;
+
+    initializeSirenTable();
+}
+
+/*******************************************************************************
+ * Function:    playTune
+ *
+ * PreCondition: initializeBuzzer must have been called
+ * Input:   The tune to play, a stream of note number and length pairs ended by
+ *          TUNE_END
+ * Output:  none
+ * Side Effects: Starts TIMER_TUNE
+ *
+ * Overview: Stops any tune that is playing and starts the first note of the
+ *           new one. The rest of the notes are played by tuneStep.
+ *
+ * Note: Returns immediately, the CPU is free while the tune plays.
+ * ****************************************************************************/
+void playTune (const unsigned char *tune)
+{
+    timerStop(TIMER_TUNE);
+
+    tuneNext = tune;
+    tuneStep();
+}
+
+/*******************************************************************************
+ * Function:    tuneStep
+ *
+ * PreCondition: playTune must have been called
+ * Input:   none
+ * Output:  none
+ * Side Effects: Starts TIMER_TUNE for the length of the note
+ *
+ * Overview: TIMER_TUNE callback, plays the next note of the tune and sets the
+ *           timer to come back when it is over. NOTE_REST silences the buzzer
+ *           for its length and TUNE_END turns it off for good.
+ *
+ * Note: Runs inside the Timer1 interrupt, apart from the first note.
+ * ****************************************************************************/
+void tuneStep (void)
+{
+    unsigned char note = tuneNext[0];
+
+    if (note == TUNE_END)
+    {
+        buzzerOff();
+        return;
+    }
+
+    if (note == NOTE_REST)
+    {
+        buzzerOff();
+    }
+    else
+    {
+        buzzerOn(notePeriods[note]);
+    }
+
+    timerStart(TIMER_TUNE, tuneNext[1] * TUNE_TIME_UNIT, 0, tuneStep);
+    tuneNext += 2;
+}
+
+/*******************************************************************************
+ * Function:    buzzerOn
+ *
+ * PreCondition: initializeBuzzer must have been called
+ * Input:   The tone period in timer ticks, up to 65535 (~61Hz)
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Sets OC1 to output a square wave with the given period, or changes
+ *           the period of a tone that is already playing.
+ *
+ * Note: OC1RS is only loaded at the end of a period, but PR2 takes effect at
+ *       once, so the count is restarted if it is already past the new period.
+ * ****************************************************************************/
+void buzzerOn (unsigned int period)
+{
+    PR2 = period - 1;
+    OC1RS = period / 2; //50% duty cycle
+
+    if (OC1CONbits.OCM != OC_PWM_MODE)
+    {
+        OC1R = period / 2;
+        TMR2 = 0;
+        OC1CONbits.OCM = OC_PWM_MODE;
+        T2CONbits.TON = 1;
+    }
+    else if (TMR2 >= period)
+    {
+        TMR2 = 0;
+    }
+}
+
+/*******************************************************************************
+ * Function:    buzzerOff
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: none
+ *
+ * Overview: Stops the tone and Timer2.
+ *
+ * Note:
+ * ****************************************************************************/
+void buzzerOff (void)
+{
+    OC1CONbits.OCM = 0;
+    T2CONbits.TON = 0;
+}
+
+/*******************************************************************************
+ * Function:    initializeSirenTable
+ *
+ * PreCondition: none
+ * Input:   none
+ * Output:  none
+ * Side Effects: Fills sirenTable
+ *
+ * Overview: The siren sweep starts with 0.6ms high and 0.6ms low pulses and
+ *           every pulse is 1us shorter than the one before, so the pitch rises
+ *           steadily. This walks through the SIREN_PULSES pulses of one sweep
+ *           and records the period playing at the start of each SIREN_STEP,
+ *           so the sweep can be replayed from a timer without timing every
+ *           single pulse.
+ *
+ * Note: One sweep lasts about 640ms, which is SIREN_STEPS steps.
+ * ****************************************************************************/
+void initializeSirenTable (void)
+{
+    unsigned long elapsed = 0; //Ticks since the start of the sweep
+    unsigned long nextStep = 0; //Start of the next table entry, in ticks
+    unsigned int period = SIREN_START_PERIOD;
+    int step = 0;
+    int pulse;
+
+    for (pulse = 0; pulse < SIREN_PULSES && step < SIREN_STEPS; pulse++)
+    {
+        while (step < SIREN_STEPS && elapsed >= nextStep)
+        {
+            sirenTable[step++] = period;
+            nextStep += MS_TO_TICKS(SIREN_STEP);
+        }
+
+        elapsed += period;
+        period -= SIREN_PERIOD_STEP;
+    }
+
+    //Hold the top pitch if the sweep ends before the table is full
+    while (step < SIREN_STEPS)
+    {
+        sirenTable[step++] = period;
+    }
+}
+
+/*******************************************************************************
+ * Function:    fireAlarm
+ *
+ * PreCondition: Called by the audio task, not from an interrupt
+ * Input:   none
+ * Output:  none
+ * Side Effects: Starts TIMER_SIREN
+ *
+ * Overview: Starts the siren. TIMER_SIREN plays sirenTable through the buzzer
+ *           SIREN_REPEATS times, while the CPU is left free to bring the car
+ *           down.
+ *
+ * Note: The siren is finished once TIMER_SIREN is no longer running.
+ * ****************************************************************************/
+void fireAlarm (void)
+{
+    timerStop(TIMER_TUNE); //Do not let a tune cut the alarm short
+
+    sirenIndex = 0;
+    sirenRepeats = SIREN_REPEATS;
+
+    buzzerOn(sirenTable[sirenIndex++]);
+    timerStart(TIMER_SIREN, SIREN_STEP, SIREN_STEP, sirenStep);
+}
+
+/*******************************************************************************
+ * Function:    sirenStep
+ *
+ * PreCondition: fireAlarm must have been called
+ * Input:   none
+ * Output:  none
+ * Side Effects: Changes the buzzer pitch
+ *
+ * Overview: TIMER_SIREN callback, moves the buzzer on to the next period of
+ *           sirenTable. At the end of a sweep it starts again from the lowest
+ *           pitch, and after the last sweep it turns the buzzer off.
+ *
+ * Note: Runs inside the Timer1 interrupt.
+ * ****************************************************************************/
+void sirenStep (void)
+{
+    if (sirenIndex == SIREN_STEPS)
+    {
+        sirenIndex = 0;
+        sirenRepeats--;
+
+        if (sirenRepeats == 0)
+        {
+            timerStop(TIMER_SIREN);
+            buzzerOff();
+            return;
+        }
+    }
+
+    buzzerOn(sirenTable[sirenIndex++]);
 }
 
 